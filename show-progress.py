@@ -55,10 +55,12 @@ def monitor(connstr, interval, outputdir, dot, waitq, reportq, q):
         cur.execute('select pg_progress_update(%s)', (query_pid, ))
 
         if dot:
-            cur.execute('select pg_progress_dot()')
+            cur.execute('select pg_progress_dot(%s)', (query_pid, ))
             snapshots.append(cur.fetchone()[0])
 
-        cur.execute('select pg_progress()')
+        # NULL until the query backend publishes anything, and None is the
+        # end of monitoring for the reporter
+        cur.execute('select coalesce(pg_progress(%s), 0)', (query_pid, ))
         reportq.put(cur.fetchone()[0])
 
         try:
@@ -1,17 +1,94 @@
 -- complain if script is sourced in psql, rather than via CREATE EXTENSION
 \echo Use "CREATE EXTENSION progress" to load this file. \quit
 
-CREATE OR REPLACE FUNCTION pg_progress_update(int)
+CREATE OR REPLACE FUNCTION pg_progress_update(int, bool DEFAULT true)
 RETURNS bool
 AS '$libdir/progress', 'pg_progress_update'
 LANGUAGE C STRICT;
 
-CREATE OR REPLACE FUNCTION pg_progress()
+CREATE OR REPLACE FUNCTION pg_progress(int)
 RETURNS double precision
 AS '$libdir/progress', 'pg_progress'
 LANGUAGE C STRICT;
 
-CREATE OR REPLACE FUNCTION pg_progress_dot()
+CREATE OR REPLACE FUNCTION pg_progress_dot(int)
 RETURNS text
 AS '$libdir/progress', 'pg_progress_dot'
 LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION pg_progress_json(int)
+RETURNS json
+AS '$libdir/progress', 'pg_progress_json'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION pg_progress_nodes(
+    IN pid int,
+    OUT node_id int,
+    OUT parent_id int,
+    OUT plan_node_name text,
+    OUT pipeline_id int,
+    OUT is_driver bool,
+    OUT tup_processed double precision,
+    OUT tup_estimated double precision,
+    OUT rate double precision,
+    OUT blks_read double precision,
+    OUT blks_written double precision
+)
+RETURNS SETOF record
+AS '$libdir/progress', 'pg_progress_nodes'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION pg_progress_history(
+    IN pid int,
+    OUT sample_time timestamptz,
+    OUT progress double precision
+)
+RETURNS SETOF record
+AS '$libdir/progress', 'pg_progress_history'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION pg_progress_accuracy(
+    OUT queryid bigint,
+    OUT calls bigint,
+    OUT samples bigint,
+    OUT total_time double precision,
+    OUT mean_abs_error double precision,
+    OUT max_abs_error double precision,
+    OUT trace double precision[],
+    OUT pipeline_estimated double precision[],
+    OUT pipeline_actual double precision[]
+)
+RETURNS SETOF record
+AS '$libdir/progress', 'pg_progress_accuracy'
+LANGUAGE C;
+
+CREATE VIEW pg_progress_accuracy AS
+  SELECT * FROM pg_progress_accuracy();
+
+CREATE OR REPLACE FUNCTION pg_progress_command(
+    IN pid int,
+    OUT command text,
+    OUT phase text,
+    OUT progress double precision,
+    OUT bytes_done double precision,
+    OUT bytes_total double precision,
+    OUT rows_done double precision,
+    OUT rows_total double precision,
+    OUT rate double precision
+)
+RETURNS record
+AS '$libdir/progress', 'pg_progress_command'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION pg_progress_backends(
+    OUT pid int,
+    OUT running bool,
+    OUT query_start timestamptz,
+    OUT progress double precision,
+    OUT bottleneck_pipeline int,
+    OUT command text,
+    OUT phase text
+)
+RETURNS SETOF record
+AS '$libdir/progress', 'pg_progress_backends'
+LANGUAGE C;
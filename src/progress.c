@@ -9,18 +9,37 @@
  */
 #include "postgres.h"
 
+#include <math.h>
+
+#include "funcapi.h"
 #include "miscadmin.h"
 #include "nodes/bitmapset.h"
+#include "storage/barrier.h"
+#include "storage/dsm.h"
 #include "storage/procsignal.h"
 #include "storage/ipc.h"
+#include "storage/shmem.h"
+#include "access/hash.h"
+#include "access/htup_details.h"
+#include "tcop/utility.h"
 #include "executor/executor.h"
 #include "executor/hashjoin.h"
+#include "optimizer/cost.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/json.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
 #include "lib/stringinfo.h"
 
 #include "progress.h"
+#include "progress_accuracy.h"
+#include "progress_rowcache.h"
 #include "progress_util.h"
 #include "progress_pipeline.h"
+#include "progress_recorder.h"
+#include "progress_sampler.h"
+#include "progress_utility.h"
 
 PG_MODULE_MAGIC;
 
@@ -30,13 +49,58 @@ static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 static procsignal_handler_hook_type prev_procsignal_handler_hook = NULL;
 static ExecutorStart_hook_type prev_ExecutorStart_hook = NULL;
 static ExecutorRun_hook_type prev_ExecutorRun_hook = NULL;
+static ExecutorFinish_hook_type prev_ExecutorFinish_hook = NULL;
+static ExecutorEnd_hook_type prev_ExecutorEnd_hook = NULL;
+static ProcessUtility_hook_type prev_ProcessUtility_hook = NULL;
 
 /* global reference to the backend's currently executing query */
 static volatile QueryDesc	*currentQueryDesc = NULL;
 
+/* current nesting depth of ExecutorRun and ExecutorFinish calls */
+static int	nesting_level = 0;
+
+/*
+ * Estimates published for the current top-level query, used to log the
+ * estimator's accuracy once it finishes. If the query publishes more than
+ * PROGRESS_TRACE_MAX estimates, every other one is dropped and only every
+ * trace_every-th one is recorded from then on.
+ */
+#define PROGRESS_TRACE_MAX 1024
+
+static QueryDesc			*tracedQueryDesc = NULL;
+static bool					 trace_ran = false;
+static TimestampTz			 trace_start;
+static ProgressTracePoint	*trace_points = NULL;
+static int					 trace_no_points = 0;
+static int					 trace_every = 1;
+static int					 trace_seen = 0;
+
+/* the query whose counters are being recorded, if any */
+static QueryDesc			*recordedQueryDesc = NULL;
+
 /* pointer to shared memory state */
 static ProgressSharedState	*progress_state = NULL;
 
+/*
+ * This backend's directory slot and the segment holding its last snapshot.
+ * The segment is only created and replaced outside of the signal hook, which
+ * leaves the segment alone while it's being replaced and asks for a bigger one
+ * by setting my_snapshot_wanted when a snapshot doesn't fit.
+ */
+static ProgressSlot			*my_slot = NULL;
+static dsm_segment			*my_snapshot = NULL;
+static Size					 my_snapshot_capacity = 0;
+static volatile Size		 my_snapshot_wanted = 0;
+static volatile bool		 my_snapshot_replacing = false;
+
+/* room for a node's label and the edge to it in the DOT dump */
+#define PROGRESS_DOT_NODE_SIZE 256
+
+/* GUC variables */
+static int	progress_max_backends = 100;
+static int	progress_history_size = 1000;
+static bool	progress_track_io = false;
+
 
 /***********************/
 /* Progress estimation */
@@ -52,6 +116,31 @@ processed_Hash(HashState *node)
 }
 
 
+static double node_tup_processed(PlanState *node);
+
+
+/*
+ * Rows written by a ModifyTable. Unless it has RETURNING, it doesn't return
+ * anything until it's done, so count the rows modified. Only the statement's
+ * own ModifyTable updates es_processed, those in WITH just count the rows
+ * their subplans returned.
+ */
+static double
+processed_ModifyTable(ModifyTableState *node)
+{
+	double	ret = 0.0;
+	int		i;
+
+	if (((ModifyTable *) node->ps.plan)->canSetTag)
+		return node->ps.state->es_processed;
+
+	for (i = 0; i < node->mt_nplans; i++)
+		ret += node_tup_processed(node->mt_plans[i]);
+
+	return ret;
+}
+
+
 static double
 node_tup_processed(PlanState *node)
 {
@@ -59,6 +148,10 @@ node_tup_processed(PlanState *node)
 
 	switch (nodeTag(node))
 	{
+		case T_ModifyTableState:
+			ret = processed_ModifyTable((ModifyTableState *) node);
+			break;
+
 		case T_HashState:
 			ret = processed_Hash((HashState *) node);
 
@@ -70,6 +163,318 @@ node_tup_processed(PlanState *node)
 }
 
 
+/*
+ * Rows an Append is expected to return, summed over its children. Children
+ * before the current one are done, so they count with what they returned.
+ */
+static double
+estimated_Append(AppendState *node)
+{
+	bool	finished = PROGRESS_INSTR(node)->finished;
+	double	ret		 = 0.0;
+	int		i;
+
+	for (i = 0; i < node->as_nplans; i++)
+	{
+		PlanState	*child = node->appendplans[i];
+
+		if (finished || i < node->as_whichplan)
+			ret += node_tup_processed(child);
+		else
+			ret += Max(node_tup_processed(child),
+					   PROGRESS_INSTR(child)->tup_estimated);
+	}
+
+	return ret;
+}
+
+
+/* a MergeAppend reads all of its children at once */
+static double
+estimated_MergeAppend(MergeAppendState *node)
+{
+	double	ret = 0.0;
+	int		i;
+
+	for (i = 0; i < node->ms_nplans; i++)
+	{
+		PlanState	*child = node->mergeplans[i];
+
+		if (PROGRESS_INSTR(child)->finished)
+			ret += node_tup_processed(child);
+		else
+			ret += Max(node_tup_processed(child),
+					   PROGRESS_INSTR(child)->tup_estimated);
+	}
+
+	return ret;
+}
+
+
+/*
+ * Each iteration of a recursive query rescans the recursive term, so its loop
+ * count is the number of iterations done. Assume the rows per iteration decay
+ * geometrically from the non-recursive term's rows to the last iteration's
+ * rows, and extrapolate the remaining iterations from that. If the rows don't
+ * decay, there's no telling when the recursion stops, so stick with the
+ * planner's estimate.
+ */
+static double
+estimated_RecursiveUnion(RecursiveUnionState *node)
+{
+	ProgressInstr	*instr = PROGRESS_INSTR(node);
+	PlanState		*inner = innerPlanState(node);
+	double			 first;
+	double			 decay;
+	double			 current;
+
+	first = node_tup_processed(outerPlanState(node));
+	if (instr->iterations == 0.0 || first == 0.0)
+		return instr->tup_estimated;
+
+	decay = pow(instr->iter_tup_last / first, 1.0 / instr->iterations);
+	if (decay >= 1.0)
+		return instr->tup_estimated;
+
+	current = instr->iter_tup_last * decay;
+
+	return first + instr->iter_tup_total +
+		Max(current, inner->instrument->tuplecount) +
+		current * decay / (1.0 - decay);
+}
+
+
+/*
+ * Rows a ModifyTable is expected to write. Like in an Append, its subplans
+ * run one after another.
+ */
+static double
+estimated_ModifyTable(ModifyTableState *node)
+{
+	bool	finished = PROGRESS_INSTR(node)->finished;
+	double	ret		 = 0.0;
+	int		i;
+
+	for (i = 0; i < node->mt_nplans; i++)
+	{
+		PlanState	*child = node->mt_plans[i];
+
+		if (finished || i < node->mt_whichplan)
+			ret += node_tup_processed(child);
+		else
+			ret += Max(node_tup_processed(child),
+					   PROGRESS_INSTR(child)->tup_estimated);
+	}
+
+	return ret;
+}
+
+
+static double
+node_tup_estimated(PlanState *node)
+{
+	switch (nodeTag(node))
+	{
+		case T_ModifyTableState:
+			return estimated_ModifyTable((ModifyTableState *) node);
+
+		case T_RecursiveUnionState:
+			return estimated_RecursiveUnion((RecursiveUnionState *) node);
+
+		case T_AppendState:
+			return estimated_Append((AppendState *) node);
+
+		case T_MergeAppendState:
+			return estimated_MergeAppend((MergeAppendState *) node);
+
+		default:
+			return PROGRESS_INSTR(node)->tup_estimated;
+	}
+}
+
+
+/*
+ * Record the rows returned by the iterations of a recursive query completed
+ * since the last progress calculation.
+ */
+static void
+recursion_walker(PlanState *node, List *children, void *context)
+{
+	ProgressInstr	*instr = PROGRESS_INSTR(node);
+	Instrumentation	*inner;
+
+	if (!IsA(node, RecursiveUnionState))
+		return;
+
+	inner = innerPlanState(node)->instrument;
+	if (inner->nloops <= instr->iterations)
+		return;
+
+	instr->iter_tup_last = (inner->ntuples - instr->iter_tup_total) /
+		(inner->nloops - instr->iterations);
+	instr->iterations = inner->nloops;
+	instr->iter_tup_total = inner->ntuples;
+}
+
+
+static void
+buffer_usage_add(BufferUsage *dst, const BufferUsage *add, int sign)
+{
+	dst->shared_blks_hit += sign * add->shared_blks_hit;
+	dst->shared_blks_read += sign * add->shared_blks_read;
+	dst->shared_blks_written += sign * add->shared_blks_written;
+	dst->local_blks_hit += sign * add->local_blks_hit;
+	dst->local_blks_read += sign * add->local_blks_read;
+	dst->local_blks_written += sign * add->local_blks_written;
+	dst->temp_blks_read += sign * add->temp_blks_read;
+	dst->temp_blks_written += sign * add->temp_blks_written;
+}
+
+
+/*
+ * Buffer usage counters include the node's children, so subtract their
+ * counters to get the blocks accessed by the node itself.
+ */
+static void
+io_walker(PlanState *node, List *children, void *context)
+{
+	ProgressInstr	*instr = PROGRESS_INSTR(node);
+	BufferUsage		 own;
+	ListCell		*lc;
+
+	if (!node->instrument->need_bufusage)
+		return;
+
+	own = node->instrument->bufusage;
+	foreach(lc, children)
+	{
+		PlanState	*child = (PlanState *) lfirst(lc);
+
+		buffer_usage_add(&own, &child->instrument->bufusage, -1);
+	}
+
+	instr->blks_hit = own.shared_blks_hit + own.local_blks_hit;
+	instr->blks_read = own.shared_blks_read + own.local_blks_read;
+	instr->blks_written = own.shared_blks_written + own.local_blks_written;
+	instr->temp_blks_read = own.temp_blks_read;
+	instr->temp_blks_written = own.temp_blks_written;
+}
+
+
+/*
+ * The I/O work model counts reading or writing a block as this many tuples,
+ * using the ratio of the planner's own costs.
+ */
+static double
+io_block_weight(void)
+{
+	if (cpu_tuple_cost <= 0.0)
+		return 1.0;
+
+	return seq_page_cost / cpu_tuple_cost;
+}
+
+
+/* rough size of a WAL record header and the fixed part of its data */
+#define PROGRESS_WAL_RECORD_OVERHEAD 64
+
+/*
+ * Work done for each row written by a ModifyTable, in tuples. Every index
+ * insert counts as much as the heap insert. With progress.track_io, the WAL
+ * written for the row counts as I/O too, assuming one record for the heap
+ * tuple and one for each index entry.
+ */
+static double
+write_work_per_row(ModifyTableState *node)
+{
+	ResultRelInfo	*rinfo;
+	double			 work;
+	double			 wal_bytes;
+	int				 which;
+
+	which = Min(Max(node->mt_whichplan, 0), node->mt_nplans - 1);
+	rinfo = node->resultRelInfo + which;
+
+	work = 1.0 + rinfo->ri_NumIndices;
+
+	if (progress_track_io)
+	{
+		wal_bytes = PROGRESS_WAL_RECORD_OVERHEAD * (1 + rinfo->ri_NumIndices);
+		if (node->operation != CMD_DELETE)
+			wal_bytes += node->mt_plans[which]->plan->plan_width;
+
+		work += io_block_weight() * wal_bytes / BLCKSZ;
+	}
+
+	return work;
+}
+
+
+/* work done for each row a node processes, in tuples */
+static double
+node_row_weight(PlanState *node)
+{
+	ModifyTableState	*mtstate = (ModifyTableState *) node;
+
+	if (IsA(node, ModifyTableState) && mtstate->mt_nplans > 0)
+		return write_work_per_row(mtstate);
+
+	return 1.0;
+}
+
+
+static double
+node_blks_processed(ProgressInstr *instr)
+{
+	return instr->blks_read + instr->blks_written +
+		instr->temp_blks_read + instr->temp_blks_written;
+}
+
+
+/*
+ * Work done by a node so far, in tuples. With progress.track_io, block reads
+ * and writes that missed the buffer cache count as extra work.
+ */
+static double
+node_work_processed(PlanState *node)
+{
+	ProgressInstr	*instr = PROGRESS_INSTR(node);
+	double			 work  = node_tup_processed(node) * node_row_weight(node);
+
+	if (progress_track_io)
+		work += io_block_weight() * node_blks_processed(instr);
+
+	return work;
+}
+
+
+/*
+ * Total work a node is expected to do. Only the fraction of relation blocks
+ * that missed the cache so far is expected to be read from disk, assuming a
+ * cold cache until the node accesses any blocks.
+ */
+static double
+node_work_estimated(PlanState *node)
+{
+	ProgressInstr	*instr = PROGRESS_INSTR(node);
+	double			 work  = node_tup_estimated(node) * node_row_weight(node);
+	double			 accessed;
+	double			 miss_ratio;
+	double			 blks;
+
+	if (progress_track_io)
+	{
+		accessed = instr->blks_hit + instr->blks_read;
+		miss_ratio = accessed > 0.0 ? instr->blks_read / accessed : 1.0;
+
+		blks = instr->blks_estimated * miss_ratio + instr->temp_blks_estimated;
+		work += io_block_weight() * Max(blks, node_blks_processed(instr));
+	}
+
+	return work;
+}
+
+
 static double
 dne_estimator(List *nodes)
 {
@@ -82,14 +487,13 @@ dne_estimator(List *nodes)
 	foreach(lc, nodes)
 	{
 		PlanState		*node = (PlanState *) lfirst(lc);
-		ProgressInstr	*instr = PROGRESS_INSTR(node);
 
 		if (tup_estimated == 0.0)
-			tup_estimated = instr->tup_estimated;
+			tup_estimated = node_work_estimated(node);
 		else
-			tup_estimated = Min(tup_estimated, instr->tup_estimated);
+			tup_estimated = Min(tup_estimated, node_work_estimated(node));
 
-		tup_processed += node_tup_processed(node);
+		tup_processed += node_work_processed(node);
 	}
 
 	tup_processed /= list_length(nodes);
@@ -145,6 +549,83 @@ estimate_progress(PipelineData *pdata, int no_pipelines)
 }
 
 
+static void
+scale_loops_walker(PlanState *node, List *children, void *context)
+{
+	ProgressInstr	*instr = PROGRESS_INSTR(node);
+	double			 ratio = *(double *) context;
+
+	instr->loops_estimated *= ratio;
+	instr->tup_estimated *= ratio;
+	instr->blks_estimated *= ratio;
+	instr->temp_blks_estimated *= ratio;
+}
+
+
+/*
+ * The planner has no idea how many times a correlated SubPlan will run, so
+ * once the node evaluating it returned some tuples, extrapolate from the
+ * number of rescans seen so far. A rescan in progress counts as a loop. The
+ * estimates of the whole subtree are scaled accordingly.
+ */
+static void
+subplan_loops_walker(PlanState *node, List *children, void *context)
+{
+	ProgressInstr	*instr = PROGRESS_INSTR(node);
+	double			 processed;
+	ListCell		*lc;
+
+	processed = node_tup_processed(node);
+	if (processed == 0.0)
+		return;
+
+	foreach(lc, node->subPlan)
+	{
+		SubPlanState	*sstate	  = (SubPlanState *) lfirst(lc);
+		PlanState		*sub	  = sstate->planstate;
+		ProgressInstr	*subinstr = PROGRESS_INSTR(sub);
+		double			 loops;
+		double			 ratio;
+
+		if (!subplan_is_correlated(sstate))
+			continue;
+
+		loops = sub->instrument->nloops + (sub->instrument->running ? 1 : 0);
+		if (loops == 0.0 || subinstr->loops_estimated <= 0.0)
+			continue;
+
+		if (!instr->finished)
+			loops *= Max(processed, instr->tup_estimated) / processed;
+		ratio = loops / subinstr->loops_estimated;
+
+		plan_state_walker(sub, scale_loops_walker, &ratio);
+	}
+}
+
+
+/* the pipeline expected to do the most work from now on */
+static int
+bottleneck_pipeline(PipelineData *pdata, int no_pipelines)
+{
+	int			i;
+	int			ret = -1;
+	double		max_left = 0.0;
+
+	for (i = 0; i < no_pipelines; i++)
+	{
+		double	left = pipeline_to_process(&pdata[i]) - pdata[i].tup_processed;
+
+		if (left > max_left)
+		{
+			max_left = left;
+			ret = i;
+		}
+	}
+
+	return ret;
+}
+
+
 static void
 estimator_walker(PlanState *node, List *children, void *context)
 {
@@ -154,9 +635,9 @@ estimator_walker(PlanState *node, List *children, void *context)
 
 	this_pdata = &pdata[instr->pipeline_id];
 
-	this_pdata->tup_processed += node_tup_processed(node);
-	this_pdata->tup_estimated += Max(node_tup_processed(node),
-									 instr->tup_estimated);
+	this_pdata->tup_processed += node_work_processed(node);
+	this_pdata->tup_estimated += Max(node_work_processed(node),
+									 node_work_estimated(node));
 	if (instr->is_driver)
 		this_pdata->driver_nodes = lappend(this_pdata->driver_nodes, node);
 }
@@ -183,52 +664,787 @@ dot_dump_walker(PlanState *node, List *children, void *context)
 		appendStringInfo(si, ", fillcolor=\"#cdcdcd\", style=filled");
 	appendStringInfo(si, "];\n");
 
-	foreach(lc, children)
+	foreach(lc, children)
+	{
+		PlanState *child = (PlanState *) lfirst(lc);
+
+		appendStringInfoSpaces(si, 4);
+		appendStringInfo(si, "P%p -> P%p;\n", node, child);
+	}
+}
+
+
+/******************/
+/* Node snapshots */
+/******************/
+
+/* size of a snapshot of a plan, without the DOT dump */
+static Size
+snapshot_base_size(int no_nodes)
+{
+	return add_size(offsetof(ProgressSnapshot, nodes),
+					mul_size(no_nodes, sizeof(ProgressNodeSnapshot)));
+}
+
+
+typedef struct SnapshotContext
+{
+	ProgressSnapshot	*snapshot;
+	double				 elapsed;	/* seconds since the previous snapshot */
+} SnapshotContext;
+
+
+/*
+ * Fill in a node's entry in the snapshot. The rate is computed from the
+ * tuples processed since the previous snapshot of the same query.
+ */
+static void
+snapshot_walker(PlanState *node, List *children, void *context)
+{
+	SnapshotContext			*ctx   = context;
+	ProgressInstr			*instr = PROGRESS_INSTR(node);
+	ProgressNodeSnapshot	*snode = &ctx->snapshot->nodes[instr->node_id];
+	double					 processed;
+
+	processed = node_tup_processed(node);
+
+	snode->node_id = instr->node_id;
+	snode->parent_id = instr->parent_id;
+	strlcpy(snode->name, plan_node_name(node), PROGRESS_NODE_NAME_LEN);
+	snode->pipeline_id = instr->pipeline_id;
+	snode->is_driver = instr->is_driver;
+	snode->tup_processed = processed;
+	snode->tup_estimated = node_tup_estimated(node);
+	snode->rate = 0.0;
+	if (ctx->elapsed > 0.0)
+		snode->rate = (processed - instr->tup_last_sample) / ctx->elapsed;
+	/* only collected with progress.track_io, zero otherwise */
+	snode->blks_read = instr->blks_read + instr->temp_blks_read;
+	snode->blks_written = instr->blks_written + instr->temp_blks_written;
+
+	instr->tup_last_sample = processed;
+}
+
+
+/*****************************/
+/* Shared progress directory */
+/*****************************/
+
+/*
+ * Bracket an update of this backend's slot. An update interrupted by the
+ * signal hook nests the hook's update inside it, which leaves the count odd
+ * until the outer update is done.
+ */
+static void
+begin_slot_update(void)
+{
+	my_slot->changecount++;
+	pg_write_barrier();
+}
+
+
+static void
+end_slot_update(void)
+{
+	pg_write_barrier();
+	my_slot->changecount++;
+}
+
+
+/*
+ * Read a slot consistently with its owner's updates, as in
+ *
+ *		do
+ *		{
+ *			count = begin_slot_read(slot);
+ *			... copy what's needed ...
+ *		} while (retry_slot_read(slot, count));
+ *
+ * The caller must hold the directory lock, so that the slot isn't released
+ * meanwhile. The owner never waits for anything while updating its slot, so
+ * this doesn't spin for long.
+ */
+static int
+begin_slot_read(ProgressSlot *slot)
+{
+	volatile ProgressSlot	*vslot = slot;
+	int						 count;
+
+	do
+		count = vslot->changecount;
+	while (count & 1);
+
+	pg_read_barrier();
+
+	return count;
+}
+
+
+static bool
+retry_slot_read(ProgressSlot *slot, int count)
+{
+	volatile ProgressSlot	*vslot = slot;
+
+	pg_read_barrier();
+
+	return vslot->changecount != count;
+}
+
+
+static void
+progress_shmem_exit(int code, Datum arg)
+{
+	if (my_slot == NULL)
+		return;
+
+	LWLockAcquire(progress_state->lock, LW_EXCLUSIVE);
+	begin_slot_update();
+	my_slot->pid = 0;
+	my_slot->running = false;
+	my_slot->estimate = 0.0;
+	my_slot->snapshot_size = 0;
+	my_slot->history_count = 0;
+	end_slot_update();
+	LWLockRelease(progress_state->lock);
+
+	my_slot = NULL;
+
+	if (my_snapshot != NULL)
+	{
+		dsm_detach(my_snapshot);
+		my_snapshot = NULL;
+		my_snapshot_capacity = 0;
+	}
+}
+
+
+/*
+ * Find the directory slot belonging to a backend. The caller must hold the
+ * directory lock.
+ */
+static ProgressSlot *
+find_slot(int pid)
+{
+	int		i;
+
+	for (i = 0; i < progress_state->max_slots; i++)
+	{
+		if (progress_state->slots[i].pid == pid)
+			return &progress_state->slots[i];
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Claim a free directory slot for this backend. The caller must hold the
+ * directory lock in exclusive mode. Returns NULL if the directory is full.
+ */
+static ProgressSlot *
+claim_slot(void)
+{
+	ProgressSlot	*slot;
+
+	slot = find_slot(0);
+	if (slot == NULL)
+		return NULL;
+
+	slot->pid = MyProcPid;
+	slot->snapshot_requested = false;
+	slot->running = false;
+	slot->estimate = 0.0;
+	slot->bottleneck = -1;
+	slot->snapshot_size = 0;
+	slot->history_next = 0;
+	slot->history_count = 0;
+
+	/* the snapshot segment must be detached before DSM shuts down */
+	before_shmem_exit(progress_shmem_exit, (Datum) 0);
+
+	return slot;
+}
+
+
+/*
+ * Mark the start or the end of an instrumented query in this backend's slot.
+ * Starting a query resets the slot's history. The directory lock is only
+ * taken to claim a slot, the first time this backend needs one.
+ */
+static void
+set_query_running(bool running)
+{
+	static bool		warned = false;
+	TimestampTz		now;
+
+	if (my_slot == NULL && running)
+	{
+		LWLockAcquire(progress_state->lock, LW_EXCLUSIVE);
+		my_slot = claim_slot();
+		LWLockRelease(progress_state->lock);
+	}
+
+	if (my_slot == NULL)
+	{
+		if (running && !warned)
+			elog(WARNING, "no free progress slots, increase progress.max_backends");
+		warned = true;
+		return;
+	}
+
+	now = GetCurrentTimestamp();
+
+	begin_slot_update();
+	my_slot->running = running;
+	if (running)
+	{
+		my_slot->query_start = now;
+		my_slot->bottleneck = -1;
+		my_slot->snapshot_size = 0;
+		my_slot->history_next = 0;
+		my_slot->history_count = 0;
+		my_slot->command.command[0] = '\0';
+	}
+	end_slot_update();
+}
+
+
+/*
+ * Create a DSM segment that can hold a snapshot of the given size. This runs
+ * in the middle of a query, which shouldn't fail just because its progress
+ * can't be published, so failing only results in a warning and NULL being
+ * returned.
+ */
+static dsm_segment *
+create_snapshot_segment(Size size)
+{
+	MemoryContext	 oldcontext = CurrentMemoryContext;
+	dsm_segment		*seg = NULL;
+
+	PG_TRY();
+	{
+		seg = dsm_create(size);
+		/* keep the mapping until we replace it, regardless of resource owners */
+		dsm_pin_mapping(seg);
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(oldcontext);
+		FlushErrorState();
+		seg = NULL;
+	}
+	PG_END_TRY();
+
+	if (seg == NULL)
+		elog(WARNING, "could not create a segment for the progress snapshot");
+
+	return seg;
+}
+
+
+/*
+ * Make sure this backend's snapshot segment can hold a snapshot of the given
+ * size, replacing it with a bigger one if needed. The published snapshot is
+ * carried over to the new segment. Must not be called from the signal hook.
+ */
+static void
+reserve_snapshot_segment(Size size)
+{
+	dsm_segment		*old_seg;
+	dsm_segment		*new_seg;
+	Size			 new_capacity;
+
+	my_snapshot_wanted = 0;
+
+	if (my_slot == NULL || size <= my_snapshot_capacity)
+		return;
+
+	new_capacity = Max(size, 2 * my_snapshot_capacity);
+	new_seg = create_snapshot_segment(new_capacity);
+	if (new_seg == NULL)
+		return;
+
+	old_seg = my_snapshot;
+
+	my_snapshot_replacing = true;
+	begin_slot_update();
+	if (old_seg != NULL)
+		memcpy(dsm_segment_address(new_seg), dsm_segment_address(old_seg),
+			   my_slot->snapshot_size);
+	my_snapshot = new_seg;
+	my_snapshot_capacity = new_capacity;
+	my_slot->snapshot = dsm_segment_handle(new_seg);
+	end_slot_update();
+	my_snapshot_replacing = false;
+
+	/* readers still attached to the old segment will see the update */
+	if (old_seg != NULL)
+		dsm_detach(old_seg);
+}
+
+
+/*
+ * Make a progress snapshot visible to other backends and append the estimate
+ * to the slot's history. This runs from the signal hook, which may have
+ * interrupted this backend while it held the directory lock or while it was
+ * replacing the snapshot segment, so it takes no locks and only copies data
+ * into the slot and the segment, inside a slot update. Readers copy them out
+ * and check that no update happened meanwhile. A snapshot that doesn't fit in
+ * the segment isn't published, but the segment is grown the next time the
+ * executor hooks get the chance.
+ *
+ * If snapshot is NULL, the last snapshot published for the query stays as it
+ * is. Utility commands have no plan to snapshot, the command describes their
+ * progress instead.
+ */
+static void
+publish_progress(double estimate, TimestampTz time,
+				 ProgressSnapshot *snapshot, Size size, int bottleneck,
+				 ProgressCommand *command)
+{
+	ProgressSample	*history;
+
+	if (my_slot == NULL)
+		return;
+
+	begin_slot_update();
+
+	my_slot->estimate = estimate;
+	my_slot->bottleneck = bottleneck;
+
+	/* while the segment is being replaced, keep the last snapshot */
+	if (snapshot != NULL && my_snapshot_replacing)
+		my_snapshot_wanted = size;
+	else if (snapshot != NULL && size <= my_snapshot_capacity)
+	{
+		memcpy(dsm_segment_address(my_snapshot), snapshot, size);
+		my_slot->snapshot_size = size;
+	}
+	else if (snapshot != NULL)
+	{
+		my_slot->snapshot_size = 0;
+		my_snapshot_wanted = size;
+	}
+
+	if (command != NULL)
+		my_slot->command = *command;
+	else
+		my_slot->command.command[0] = '\0';
+
+	history = ProgressSlotHistory(progress_state, my_slot);
+	history[my_slot->history_next].time = time;
+	history[my_slot->history_next].estimate = estimate;
+	my_slot->history_next = (my_slot->history_next + 1) %
+		progress_state->history_size;
+	if (my_slot->history_count < progress_state->history_size)
+		my_slot->history_count++;
+
+	end_slot_update();
+}
+
+
+/*
+ * Get the progress of the utility command a backend is running. Returns false
+ * if it isn't running one. If estimate is not NULL, it is set to the
+ * published estimate.
+ */
+static bool
+copy_command(int pid, ProgressCommand *command, double *estimate)
+{
+	ProgressSlot	*slot;
+	bool			 found = false;
+
+	if (progress_state == NULL)
+		elog(ERROR, "progress.so should be preloaded");
+
+	LWLockAcquire(progress_state->lock, LW_SHARED);
+	slot = find_slot(pid);
+	if (slot != NULL)
+	{
+		int		count;
+
+		do
+		{
+			count = begin_slot_read(slot);
+			found = slot->command.command[0] != '\0';
+			*command = slot->command;
+			if (estimate != NULL)
+				*estimate = slot->estimate;
+		} while (retry_slot_read(slot, count));
+	}
+	LWLockRelease(progress_state->lock);
+
+	return found;
+}
+
+
+/*
+ * Ask every backend running an instrumented query to publish a full progress
+ * snapshot. Returns the number of backends signalled.
+ */
+int
+progress_signal_running(void)
+{
+	int		*pids;
+	int		 no_pids = 0;
+	int		 i;
+
+	pids = palloc(sizeof(int) * progress_state->max_slots);
+
+	LWLockAcquire(progress_state->lock, LW_SHARED);
+	for (i = 0; i < progress_state->max_slots; i++)
+	{
+		ProgressSlot	*slot = &progress_state->slots[i];
+
+		if (slot->pid != 0 && slot->running)
+		{
+			slot->snapshot_requested = true;
+			pids[no_pids++] = slot->pid;
+		}
+	}
+	LWLockRelease(progress_state->lock);
+
+	/* don't send signals while holding the lock */
+	for (i = 0; i < no_pids; i++)
+		SendProcSignal(pids[i], PROCSIG_HOOK, InvalidBackendId);
+
+	pfree(pids);
+
+	return no_pids;
+}
+
+
+/*
+ * Get a private copy of the snapshot published by a backend, or NULL if it
+ * hasn't published one. Only the bytes actually used by the snapshot are
+ * copied. If estimate is not NULL, it is set to the published estimate.
+ */
+static ProgressSnapshot *
+copy_snapshot(int pid, double *estimate)
+{
+	ProgressSlot		*slot;
+	dsm_segment			*seg;
+	Size				 size;
+	ProgressSnapshot	*result = NULL;
+	int					 count;
+
+	if (progress_state == NULL)
+		elog(ERROR, "progress.so should be preloaded");
+
+	LWLockAcquire(progress_state->lock, LW_SHARED);
+	slot = find_slot(pid);
+	if (slot == NULL)
+	{
+		LWLockRelease(progress_state->lock);
+		return NULL;
+	}
+
+	/*
+	 * The publisher rewrites the segment in place, or replaces it with a
+	 * bigger one, so start over if it did either while we were copying.
+	 */
+	do
+	{
+		if (result != NULL)
+			pfree(result);
+		result = NULL;
+
+		count = begin_slot_read(slot);
+		size = slot->snapshot_size;
+		if (estimate != NULL)
+			*estimate = slot->estimate;
+		if (size == 0)
+			continue;
+
+		seg = dsm_attach(slot->snapshot);
+		if (seg != NULL)
+		{
+			result = palloc(size);
+			memcpy(result, dsm_segment_address(seg), size);
+			dsm_detach(seg);
+		}
+	} while (retry_slot_read(slot, count));
+	LWLockRelease(progress_state->lock);
+
+	return result;
+}
+
+
+/********************/
+/* Accuracy logging */
+/********************/
+
+/* without pg_stat_statements there's no query id, use the query text */
+static uint32
+query_id(QueryDesc *queryDesc)
+{
+	uint32		queryid = queryDesc->plannedstmt->queryId;
+
+	if (queryid == 0 && queryDesc->sourceText != NULL)
+		queryid = DatumGetUInt32(hash_any((const unsigned char *) queryDesc->sourceText,
+										  strlen(queryDesc->sourceText)));
+
+	return queryid;
+}
+
+
+static void
+start_trace(QueryDesc *queryDesc)
+{
+	if (trace_points == NULL)
+		trace_points = MemoryContextAlloc(TopMemoryContext,
+										  sizeof(ProgressTracePoint) *
+										  PROGRESS_TRACE_MAX);
+
+	tracedQueryDesc = queryDesc;
+	trace_ran = false;
+	trace_start = GetCurrentTimestamp();
+	trace_no_points = 0;
+	trace_every = 1;
+	trace_seen = 0;
+}
+
+
+static void
+record_trace_point(TimestampTz time, double estimate)
+{
+	long	secs;
+	int		usecs;
+	int		i;
+
+	if (trace_seen++ % trace_every != 0)
+		return;
+
+	if (trace_no_points == PROGRESS_TRACE_MAX)
+	{
+		for (i = 0; i < PROGRESS_TRACE_MAX / 2; i++)
+			trace_points[i] = trace_points[i * 2 + 1];
+		trace_no_points = PROGRESS_TRACE_MAX / 2;
+		trace_every *= 2;
+	}
+
+	TimestampDifference(trace_start, time, &secs, &usecs);
+	trace_points[trace_no_points].elapsed = secs + usecs / 1000000.0;
+	trace_points[trace_no_points].estimate = estimate;
+	trace_no_points++;
+}
+
+
+typedef struct AccuracyContext
+{
+	double		estimated[PROGRESS_ACCURACY_PIPELINES];
+	double		actual[PROGRESS_ACCURACY_PIPELINES];
+	int			no_pipelines;
+} AccuracyContext;
+
+
+static void
+accuracy_walker(PlanState *node, List *children, void *context)
+{
+	AccuracyContext		*ctx   = context;
+	ProgressInstr		*instr = PROGRESS_INSTR(node);
+
+	if (instr->pipeline_id >= PROGRESS_ACCURACY_PIPELINES)
+		return;
+
+	ctx->estimated[instr->pipeline_id] += instr->tup_estimated;
+	ctx->actual[instr->pipeline_id] += node_tup_processed(node);
+	ctx->no_pipelines = Max(ctx->no_pipelines, instr->pipeline_id + 1);
+}
+
+
+static void
+rowcache_walker(PlanState *node, List *children, void *context)
+{
+	double				*rows  = context;
+	ProgressInstr		*instr = PROGRESS_INSTR(node);
+
+	rows[instr->node_id] = node_tup_processed(node);
+}
+
+
+static void
+finish_trace(QueryDesc *queryDesc)
+{
+	AccuracyContext		 ctx;
+	uint32				 queryid;
+	long				 secs;
+	int					 usecs;
+
+	memset(&ctx, 0, sizeof(ctx));
+	plan_state_walker(queryDesc->planstate, accuracy_walker, &ctx);
+
+	queryid = query_id(queryDesc);
+
+	/* only complete runs tell how many rows the plan really produces */
+	if (PROGRESS_INSTR(queryDesc->planstate)->finished)
+	{
+		ProgressState	pstate;
+		double		   *rows;
+
+		number_plan_nodes(queryDesc->planstate, &pstate);
+		rows = palloc(sizeof(double) * pstate.no_nodes);
+		plan_state_walker(queryDesc->planstate, rowcache_walker, rows);
+		progress_rowcache_store(queryid,
+								plan_fingerprint(queryDesc->planstate),
+								pstate.no_nodes, rows);
+		pfree(rows);
+	}
+
+	TimestampDifference(trace_start, GetCurrentTimestamp(), &secs, &usecs);
+
+	progress_accuracy_store(queryid, secs + usecs / 1000000.0,
+							trace_points, trace_no_points,
+							ctx.estimated, ctx.actual, ctx.no_pipelines);
+}
+
+
+/********************/
+/* Main entry point */
+/********************/
+
+/*
+ * Update the run-time corrections of the estimates and compute the overall
+ * progress, filling in the data of each pipeline. Row counts cached from an
+ * earlier run already include every SubPlan loop, so they're not rescaled.
+ */
+static double
+run_estimator(PlanState *top, ProgressState *pstate, PipelineData *pdata)
+{
+	int		i;
+
+	for (i = 0; i < pstate->no_pipelines; i++)
+	{
+		pdata[i].tup_processed = 0;
+		pdata[i].tup_estimated = 0;
+		pdata[i].driver_nodes = NIL;
+	}
+	if (progress_track_io)
+		plan_state_walker(top, io_walker, NULL);
+	if (pstate->cached_rows == NULL)
+		plan_state_walker_preorder(top, subplan_loops_walker, NULL);
+	plan_state_walker(top, recursion_walker, NULL);
+	plan_state_walker(top, estimator_walker, pdata);
+
+	return estimate_progress(pdata, pstate->no_pipelines);
+}
+
+/*
+ * Publish the progress of the running query. The DOT dump and the per-node
+ * snapshot are only built if with_snapshot is set, otherwise just the
+ * estimate and the bottleneck pipeline are published.
+ */
+static void
+calculate_progress(volatile QueryDesc *queryDesc, bool with_snapshot)
+{
+	EState				*estate	= queryDesc->estate;
+	ProgressState		*pstate = estate->es_private;
+	PipelineData		*pdata;
+	double				 estimate;
+	int					 bottleneck;
+	StringInfoData		 si;
+	SnapshotContext		 ctx;
+	ProgressCommand		 command;
+	ProgressCommand		*commandp = NULL;
+	Size				 size = 0;
+	TimestampTz			 now;
+	long				 secs;
+	int					 usecs;
+
+	pdata = palloc(sizeof(PipelineData) * pstate->no_pipelines);
+	estimate = run_estimator(queryDesc->planstate, pstate, pdata);
+	bottleneck = bottleneck_pipeline(pdata, pstate->no_pipelines);
+
+	now = GetCurrentTimestamp();
+
+	ctx.snapshot = NULL;
+	if (with_snapshot)
 	{
-		PlanState *child = (PlanState *) lfirst(lc);
+		initStringInfo(&si);
+		appendStringInfo(&si, "digraph progress {\n");
+		plan_state_walker(queryDesc->planstate, dot_dump_walker, &si);
+		appendStringInfo(&si, "}");
 
-		appendStringInfoSpaces(si, 4);
-		appendStringInfo(si, "P%p -> P%p;\n", node, child);
+		size = add_size(snapshot_base_size(pstate->no_nodes), si.len + 1);
+
+		TimestampDifference(pstate->last_sample, now, &secs, &usecs);
+		pstate->last_sample = now;
+
+		ctx.snapshot = palloc(size);
+		ctx.snapshot->no_nodes = pstate->no_nodes;
+		ctx.snapshot->dot_len = si.len;
+		ctx.elapsed = secs + usecs / 1000000.0;
+		plan_state_walker(queryDesc->planstate, snapshot_walker, &ctx);
+		memcpy(ProgressSnapshotDot(ctx.snapshot), si.data, si.len + 1);
+
+		pfree(si.data);
+	}
+
+	if (queryDesc == tracedQueryDesc)
+		record_trace_point(now, estimate);
+
+	/* queries run by utility commands are a part of the command's progress */
+	if (progress_utility_running())
+	{
+		estimate = progress_utility_estimate(&command, estimate);
+		commandp = &command;
 	}
+
+	publish_progress(estimate, now, ctx.snapshot, size, bottleneck, commandp);
+
+	if (ctx.snapshot != NULL)
+		pfree(ctx.snapshot);
 }
 
 
-/********************/
-/* Main entry point */
-/********************/
+static void
+recording_counters_walker(PlanState *node, List *children, void *context)
+{
+	ProgressRecordingCounter	*counters = context;
+	ProgressInstr				*instr	  = PROGRESS_INSTR(node);
+	ProgressRecordingCounter	*counter  = &counters[instr->node_id];
+
+	counter->tup_processed = node_tup_processed(node);
+	counter->tup_estimated = node_tup_estimated(node);
+	counter->finished = instr->finished;
+	counter->unused = 0;
+}
+
 
+/* add the current counters and estimate to the query's recording */
 static void
-calculate_progress(volatile QueryDesc *queryDesc)
+record_sample(QueryDesc *queryDesc)
 {
-	EState				*estate	= queryDesc->estate;
-	ProgressState		*pstate = estate->es_private;
-	PipelineData		*pdata;
-	double				 estimate;
-	StringInfoData		 si;
-	int					 i;
+	ProgressState				*pstate = queryDesc->estate->es_private;
+	PipelineData				*pdata;
+	ProgressRecordingCounter	*counters;
+	double						 estimate;
+	int							 i;
 
 	pdata = palloc(sizeof(PipelineData) * pstate->no_pipelines);
+	counters = palloc(sizeof(ProgressRecordingCounter) * pstate->no_nodes);
+
+	estimate = run_estimator(queryDesc->planstate, pstate, pdata);
+	plan_state_walker(queryDesc->planstate, recording_counters_walker,
+					  counters);
+	progress_recorder_sample(estimate, counters);
+
 	for (i = 0; i < pstate->no_pipelines; i++)
-	{
-		pdata[i].tup_processed = 0;
-		pdata[i].tup_estimated = 0;
-		pdata[i].driver_nodes = NIL;
-	}
-	plan_state_walker(queryDesc->planstate, estimator_walker, pdata);
-	estimate = estimate_progress(pdata, pstate->no_pipelines);
+		list_free(pdata[i].driver_nodes);
+	pfree(pdata);
+	pfree(counters);
+}
 
-	initStringInfo(&si);
-	appendStringInfo(&si, "digraph progress {\n");
-	plan_state_walker(queryDesc->planstate, dot_dump_walker, &si);
-	appendStringInfo(&si, "}");
 
-	LWLockAcquire(progress_state->lock, LW_EXCLUSIVE);
-	progress_state->estimate = estimate;
-	strncpy(progress_state->dot_dump, si.data, PROGRESS_DOT_DUMP_SIZE);
-	progress_state->dot_dump[PROGRESS_DOT_DUMP_SIZE - 1] = '\0';
-	LWLockRelease(progress_state->lock);
+static void
+calculate_utility_progress(void)
+{
+	ProgressCommand		command;
+	double				estimate;
+
+	estimate = progress_utility_estimate(&command, -1.0);
 
-	pfree(si.data);
+	publish_progress(estimate, GetCurrentTimestamp(), NULL, 0, -1, &command);
 }
 
 
@@ -248,11 +1464,26 @@ progress_InstrAlloc(int n, int instrument_options)
 	for (i = 0; i < n; i++)
 	{
 		private = palloc(sizeof(ProgressInstr));
+		private->node_id = 0;
+		private->parent_id = -1;
 		private->pipeline_id = 0;
 		private->is_driver = false;
 		private->finished = false;
 		private->tup_estimated = 0.0;
 		private->loops_estimated = 0.0;
+		private->row_fraction = 1.0;
+		private->bounded = false;
+		private->tup_last_sample = 0.0;
+		private->blks_estimated = 0.0;
+		private->temp_blks_estimated = 0.0;
+		private->blks_hit = 0.0;
+		private->blks_read = 0.0;
+		private->blks_written = 0.0;
+		private->temp_blks_read = 0.0;
+		private->temp_blks_written = 0.0;
+		private->iterations = 0.0;
+		private->iter_tup_total = 0.0;
+		private->iter_tup_last = 0.0;
 
 		instr[i].private = private;
 	}
@@ -269,6 +1500,18 @@ progress_InstrStopNode(Instrumentation *instr, double nTuples)
 	standard_InstrStopNode(instr, nTuples);
 	if (nTuples == 0.0)
 		private->finished = true;
+
+	/* grow the snapshot segment if the signal hook found it too small */
+	if (my_snapshot_wanted > my_snapshot_capacity)
+		reserve_snapshot_segment(my_snapshot_wanted);
+
+	/*
+	 * The recording may span several runs, but the counters can only be
+	 * sampled while one of them is in progress.
+	 */
+	if (recordedQueryDesc != NULL && progress_recorder_due() &&
+		recordedQueryDesc->estate->es_private != NULL)
+		record_sample(recordedQueryDesc);
 }
 
 
@@ -280,11 +1523,47 @@ static void
 teardown_progress(QueryDesc *queryDesc)
 {
 	EState				*estate	 = queryDesc->estate;
+	ProgressState		*pstate	 = estate->es_private;
+
+	/*
+	 * Queries run by the top-level one don't change what's published. The
+	 * top-level one stops being published before its state goes away.
+	 */
+	if (nesting_level == 0)
+		currentQueryDesc = NULL;
 
-	pfree(estate->es_private);
+	if (pstate->cached_rows != NULL)
+		pfree(pstate->cached_rows);
+	pfree(pstate);
 
 	estate->es_private = NULL;
-	currentQueryDesc = NULL;
+
+	if (nesting_level == 0 && !progress_utility_running())
+		set_query_running(false);
+}
+
+
+/*
+ * Start recording a top-level query. The recording's header describes the
+ * plan, so number its nodes and find its pipelines now, the same way each run
+ * does later on.
+ */
+static void
+start_recording(QueryDesc *queryDesc)
+{
+	ProgressState		pstate;
+
+	if (!progress_recorder_enabled())
+		return;
+
+	number_plan_nodes(queryDesc->planstate, &pstate);
+	find_pipelines(queryDesc->planstate, &pstate);
+	pstate.cached_rows = NULL;
+	find_planner_estimates(queryDesc->planstate, &pstate);
+
+	if (progress_recorder_start(queryDesc->planstate, pstate.no_nodes,
+								pstate.no_pipelines, query_id(queryDesc)))
+		recordedQueryDesc = queryDesc;
 }
 
 
@@ -292,12 +1571,19 @@ static void
 progress_ExecutorStart(QueryDesc *queryDesc, int eflags)
 {
 	queryDesc->instrument_options |= INSTRUMENT_ROWS;
+	if (progress_track_io)
+		queryDesc->instrument_options |= INSTRUMENT_BUFFERS;
 
 	if (prev_ExecutorStart_hook)
 		prev_ExecutorStart_hook(queryDesc, eflags);
 	else
 		standard_ExecutorStart(queryDesc, eflags);
 
+	if (nesting_level == 0 && !(eflags & EXEC_FLAG_EXPLAIN_ONLY))
+	{
+		start_trace(queryDesc);
+		start_recording(queryDesc);
+	}
 }
 
 
@@ -307,23 +1593,65 @@ progress_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, long count)
 	ProgressState		*pstate = palloc(sizeof(ProgressState));
 	EState				*estate	 = queryDesc->estate;
 
+	number_plan_nodes(queryDesc->planstate, pstate);
 	find_pipelines(queryDesc->planstate, pstate);
+
+	/* don't bother fingerprinting the plan if the cache isn't used */
+	pstate->cached_rows = NULL;
+	if (progress_rowcache_enabled())
+	{
+		pstate->cached_rows = palloc(sizeof(double) * pstate->no_nodes);
+		if (!progress_rowcache_lookup(query_id(queryDesc),
+									  plan_fingerprint(queryDesc->planstate),
+									  pstate->no_nodes, pstate->cached_rows))
+		{
+			pfree(pstate->cached_rows);
+			pstate->cached_rows = NULL;
+		}
+	}
+
 	find_planner_estimates(queryDesc->planstate, pstate);
+	pstate->last_sample = GetCurrentTimestamp();
 
 	estate->es_private = (void *) pstate;
 
-	currentQueryDesc = queryDesc;
+	/*
+	 * Update the slot before publishing the query, so that the signal hook
+	 * doesn't publish it while the slot is being reset.
+	 */
+	if (nesting_level == 0)
+	{
+		if (!progress_utility_running())
+			set_query_running(true);
+
+		reserve_snapshot_segment(add_size(snapshot_base_size(pstate->no_nodes),
+										  mul_size(pstate->no_nodes,
+												   PROGRESS_DOT_NODE_SIZE)));
+
+		currentQueryDesc = queryDesc;
+	}
+
+	if (queryDesc == tracedQueryDesc)
+		trace_ran = true;
 
+	nesting_level++;
 	PG_TRY();
 	{
 		if (prev_ExecutorRun_hook)
 			prev_ExecutorRun_hook(queryDesc, direction, count);
 		else
 			standard_ExecutorRun(queryDesc, direction, count);
+		nesting_level--;
 		teardown_progress(queryDesc);
 	}
 	PG_CATCH();
 	{
+		nesting_level--;
+		if (queryDesc == recordedQueryDesc)
+		{
+			progress_recorder_end(false);
+			recordedQueryDesc = NULL;
+		}
 		teardown_progress(queryDesc);
 		PG_RE_THROW();
 	}
@@ -331,20 +1659,134 @@ progress_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, long count)
 }
 
 
+/*
+ * Queries run by AFTER triggers, like foreign key checks, are nested in the
+ * statement that fired them, even though they run after it's done.
+ */
+static void
+progress_ExecutorFinish(QueryDesc *queryDesc)
+{
+	nesting_level++;
+	PG_TRY();
+	{
+		if (prev_ExecutorFinish_hook)
+			prev_ExecutorFinish_hook(queryDesc);
+		else
+			standard_ExecutorFinish(queryDesc);
+		nesting_level--;
+	}
+	PG_CATCH();
+	{
+		nesting_level--;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
+
+static void
+progress_ExecutorEnd(QueryDesc *queryDesc)
+{
+	if (queryDesc == tracedQueryDesc)
+	{
+		if (trace_ran)
+			finish_trace(queryDesc);
+		tracedQueryDesc = NULL;
+	}
+
+	/* only a query whose top node returned all of its tuples completed */
+	if (queryDesc == recordedQueryDesc)
+	{
+		progress_recorder_end(PROGRESS_INSTR(queryDesc->planstate)->finished);
+		recordedQueryDesc = NULL;
+	}
+
+	if (prev_ExecutorEnd_hook)
+		prev_ExecutorEnd_hook(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+}
+
+
+/************************/
+/* Utility command hook */
+/************************/
+
+static void
+progress_ProcessUtility(Node *parsetree, const char *queryString,
+						ProcessUtilityContext context, ParamListInfo params,
+						DestReceiver *dest, char *completionTag)
+{
+	bool		tracked = false;
+
+	/*
+	 * Only track the outermost utility command, and only if it's not run by a
+	 * query, whose progress it would otherwise overwrite.
+	 */
+	if (nesting_level == 0 && currentQueryDesc == NULL &&
+		!progress_utility_running() && progress_state != NULL)
+		tracked = progress_utility_start(parsetree);
+
+	if (tracked)
+		set_query_running(true);
+
+	PG_TRY();
+	{
+		if (prev_ProcessUtility_hook)
+			prev_ProcessUtility_hook(parsetree, queryString, context, params,
+									 dest, completionTag);
+		else
+			standard_ProcessUtility(parsetree, queryString, context, params,
+									dest, completionTag);
+	}
+	PG_CATCH();
+	{
+		if (tracked)
+		{
+			progress_utility_end();
+			set_query_running(false);
+		}
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (tracked)
+	{
+		progress_utility_end();
+		set_query_running(false);
+	}
+}
+
+
 /***********************/
 /* Signal handler hook */
 /***********************/
 
+/* did anyone ask for a full snapshot since the last one? */
+static bool
+snapshot_requested(void)
+{
+	volatile ProgressSlot	*slot = my_slot;
+
+	if (slot == NULL || !slot->snapshot_requested)
+		return false;
+
+	slot->snapshot_requested = false;
+
+	return true;
+}
+
+
 static void
 progress_procsignal_handler_hook(void)
 {
 	if (prev_procsignal_handler_hook)
 		prev_procsignal_handler_hook();
 
-	if (currentQueryDesc == NULL)
-		return;
-
-	calculate_progress(currentQueryDesc);
+	if (currentQueryDesc != NULL)
+		calculate_progress(currentQueryDesc, snapshot_requested());
+	else if (progress_utility_running())
+		calculate_utility_progress();
 }
 
 
@@ -352,6 +1794,21 @@ progress_procsignal_handler_hook(void)
 /* Shared memory startup hook */
 /******************************/
 
+static Size
+progress_memsize(void)
+{
+	Size	size;
+
+	size = add_size(offsetof(ProgressSharedState, slots),
+					mul_size(progress_max_backends, sizeof(ProgressSlot)));
+	size = add_size(size, mul_size(mul_size(progress_max_backends,
+											progress_history_size),
+								   sizeof(ProgressSample)));
+
+	return size;
+}
+
+
 static void
 progress_shmem_startup_hook(void)
 {
@@ -364,15 +1821,19 @@ progress_shmem_startup_hook(void)
 
 	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
 
-	progress_state = ShmemInitStruct("progress",
-									 sizeof(ProgressSharedState), &found);
+	progress_state = ShmemInitStruct("progress", progress_memsize(), &found);
 	if (!found)
 	{
 		progress_state->lock = LWLockAssign();
-		progress_state->estimate = 0.0;
-		memset(progress_state->dot_dump, 0, PROGRESS_DOT_DUMP_SIZE);
+		progress_state->max_slots = progress_max_backends;
+		progress_state->history_size = progress_history_size;
+		memset(progress_state->slots, 0,
+			   progress_max_backends * sizeof(ProgressSlot));
 	}
 
+	progress_accuracy_shmem_startup();
+	progress_rowcache_shmem_startup();
+
 	LWLockRelease(AddinShmemInitLock);
 }
 
@@ -381,12 +1842,28 @@ progress_shmem_startup_hook(void)
 /* SQL interface functions */
 /***************************/
 
+/*
+ * Ask a backend to publish its progress. Unless a full snapshot is asked for,
+ * it only publishes its estimate, which is much cheaper for big plans.
+ */
 Datum
 pg_progress_update(PG_FUNCTION_ARGS)
 {
-	int ret;
+	int				 pid = PG_GETARG_INT32(0);
+	bool			 with_snapshot = PG_GETARG_BOOL(1);
+	ProgressSlot	*slot;
+	int				 ret;
+
+	if (with_snapshot && progress_state != NULL)
+	{
+		LWLockAcquire(progress_state->lock, LW_SHARED);
+		slot = find_slot(pid);
+		if (slot != NULL)
+			slot->snapshot_requested = true;
+		LWLockRelease(progress_state->lock);
+	}
 
-	ret = SendProcSignal(PG_GETARG_INT32(0), PROCSIG_HOOK, InvalidBackendId);
+	ret = SendProcSignal(pid, PROCSIG_HOOK, InvalidBackendId);
 
 	PG_RETURN_BOOL(ret == 0);
 }
@@ -395,14 +1872,26 @@ pg_progress_update(PG_FUNCTION_ARGS)
 Datum
 pg_progress(PG_FUNCTION_ARGS)
 {
-	double		val;
+	ProgressSlot	*slot;
+	double			 val;
+	int				 count;
 
 	if (progress_state == NULL)
 		elog(ERROR, "progress.so should be preloaded");
 
 	LWLockAcquire(progress_state->lock, LW_SHARED);
-	/* XXX should val be volatile? will this actually copy memory? */
-	val = progress_state->estimate;
+	slot = find_slot(PG_GETARG_INT32(0));
+	if (slot == NULL)
+	{
+		LWLockRelease(progress_state->lock);
+		PG_RETURN_NULL();
+	}
+	/* a double can be written in two parts */
+	do
+	{
+		count = begin_slot_read(slot);
+		val = slot->estimate;
+	} while (retry_slot_read(slot, count));
 	LWLockRelease(progress_state->lock);
 
 	PG_RETURN_FLOAT8(val);
@@ -412,17 +1901,370 @@ pg_progress(PG_FUNCTION_ARGS)
 Datum
 pg_progress_dot(PG_FUNCTION_ARGS)
 {
-	char		data[PROGRESS_DOT_DUMP_SIZE];
+	ProgressSnapshot	*snapshot;
+
+	snapshot = copy_snapshot(PG_GETARG_INT32(0), NULL);
+	if (snapshot == NULL)
+		PG_RETURN_NULL();
+
+	PG_RETURN_TEXT_P(cstring_to_text_with_len(ProgressSnapshotDot(snapshot),
+											  snapshot->dot_len));
+}
+
+
+/* JSON has no representation for infinities and NaNs, use null instead */
+static void
+json_append_number(StringInfo si, double val)
+{
+	if (isnan(val) || isinf(val))
+		appendStringInfoString(si, "null");
+	else
+		appendStringInfo(si, "%.17g", val);
+}
+
+
+static void
+json_append_node(StringInfo si, ProgressSnapshot *snapshot, int node_id)
+{
+	ProgressNodeSnapshot	*snode = &snapshot->nodes[node_id];
+	bool					 first = true;
+	int						 i;
+
+	appendStringInfo(si, "{\"node_id\": %d, \"plan_node_name\": ",
+					 snode->node_id);
+	escape_json(si, snode->name);
+	appendStringInfo(si, ", \"pipeline_id\": %d, \"is_driver\": %s",
+					 snode->pipeline_id, snode->is_driver ? "true" : "false");
+	appendStringInfoString(si, ", \"tup_processed\": ");
+	json_append_number(si, snode->tup_processed);
+	appendStringInfoString(si, ", \"tup_estimated\": ");
+	json_append_number(si, snode->tup_estimated);
+	appendStringInfoString(si, ", \"rate\": ");
+	json_append_number(si, snode->rate);
+	appendStringInfoString(si, ", \"blks_read\": ");
+	json_append_number(si, snode->blks_read);
+	appendStringInfoString(si, ", \"blks_written\": ");
+	json_append_number(si, snode->blks_written);
+	appendStringInfoString(si, ", \"children\": [");
+
+	for (i = 0; i < snapshot->no_nodes; i++)
+	{
+		if (snapshot->nodes[i].parent_id != node_id)
+			continue;
+
+		if (!first)
+			appendStringInfoString(si, ", ");
+		first = false;
+
+		json_append_node(si, snapshot, i);
+	}
+
+	appendStringInfoString(si, "]}");
+}
+
+
+/* unknown totals are negative, show them as null */
+static void
+json_append_total(StringInfo si, double val)
+{
+	if (val < 0.0)
+		appendStringInfoString(si, "null");
+	else
+		json_append_number(si, val);
+}
+
+
+static void
+json_append_command(StringInfo si, ProgressCommand *command)
+{
+	appendStringInfoString(si, "{\"command\": ");
+	escape_json(si, command->command);
+	appendStringInfoString(si, ", \"phase\": ");
+	escape_json(si, command->phase);
+	appendStringInfoString(si, ", \"bytes_done\": ");
+	json_append_total(si, command->bytes_done);
+	appendStringInfoString(si, ", \"bytes_total\": ");
+	json_append_total(si, command->bytes_total);
+	appendStringInfoString(si, ", \"rows_done\": ");
+	json_append_number(si, command->rows_done);
+	appendStringInfoString(si, ", \"rows_total\": ");
+	json_append_total(si, command->rows_total);
+	appendStringInfoString(si, ", \"rate\": ");
+	json_append_number(si, command->rate);
+	appendStringInfoChar(si, '}');
+}
+
+
+Datum
+pg_progress_json(PG_FUNCTION_ARGS)
+{
+	int					 pid = PG_GETARG_INT32(0);
+	ProgressSnapshot	*snapshot;
+	ProgressCommand		 command;
+	bool				 have_command;
+	double				 estimate = 0.0;
+	StringInfoData		 si;
+
+	snapshot = copy_snapshot(pid, &estimate);
+	if (snapshot != NULL && snapshot->no_nodes == 0)
+		snapshot = NULL;
+	have_command = copy_command(pid, &command,
+								snapshot == NULL ? &estimate : NULL);
+	if (snapshot == NULL && !have_command)
+		PG_RETURN_NULL();
+
+	initStringInfo(&si);
+	appendStringInfo(&si, "{\"pid\": %d, \"progress\": ", pid);
+	json_append_number(&si, estimate);
+	if (have_command)
+	{
+		appendStringInfoString(&si, ", \"command\": ");
+		json_append_command(&si, &command);
+	}
+	if (snapshot != NULL)
+	{
+		appendStringInfoString(&si, ", \"plan\": ");
+		json_append_node(&si, snapshot, 0);
+	}
+	appendStringInfoChar(&si, '}');
+
+	PG_RETURN_TEXT_P(cstring_to_text_with_len(si.data, si.len));
+}
+
+
+#define PG_PROGRESS_NODES_COLS 10
+
+Datum
+pg_progress_nodes(PG_FUNCTION_ARGS)
+{
+	ProgressSnapshot	*snapshot;
+	TupleDesc			 tupdesc;
+	Tuplestorestate		*tupstore;
+	int					 i;
+
+	tupstore = begin_materialize(fcinfo, &tupdesc);
+
+	snapshot = copy_snapshot(PG_GETARG_INT32(0), NULL);
+	if (snapshot == NULL)
+		return (Datum) 0;
+
+	for (i = 0; i < snapshot->no_nodes; i++)
+	{
+		ProgressNodeSnapshot	*snode = &snapshot->nodes[i];
+		Datum					 values[PG_PROGRESS_NODES_COLS];
+		bool					 nulls[PG_PROGRESS_NODES_COLS];
+		int						 j = 0;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[j++] = Int32GetDatum(snode->node_id);
+		if (snode->parent_id < 0)
+			nulls[j++] = true;
+		else
+			values[j++] = Int32GetDatum(snode->parent_id);
+		values[j++] = CStringGetTextDatum(snode->name);
+		values[j++] = Int32GetDatum(snode->pipeline_id);
+		values[j++] = BoolGetDatum(snode->is_driver);
+		values[j++] = Float8GetDatum(snode->tup_processed);
+		values[j++] = Float8GetDatum(snode->tup_estimated);
+		values[j++] = Float8GetDatum(snode->rate);
+		values[j++] = Float8GetDatum(snode->blks_read);
+		values[j++] = Float8GetDatum(snode->blks_written);
+
+		Assert(j == PG_PROGRESS_NODES_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+
+#define PG_PROGRESS_HISTORY_COLS 2
+
+Datum
+pg_progress_history(PG_FUNCTION_ARGS)
+{
+	ProgressSlot		*slot;
+	ProgressSample		*history;
+	ProgressSample		*samples;
+	TupleDesc			 tupdesc;
+	Tuplestorestate		*tupstore;
+	int					 count;
+	int					 changecount;
+	int					 first;
+	int					 i;
+
+	if (progress_state == NULL)
+		elog(ERROR, "progress.so should be preloaded");
+
+	tupstore = begin_materialize(fcinfo, &tupdesc);
+
+	samples = palloc(sizeof(ProgressSample) * progress_state->history_size);
+
+	/* copy the ring buffer in chronological order */
+	LWLockAcquire(progress_state->lock, LW_SHARED);
+	slot = find_slot(PG_GETARG_INT32(0));
+	count = 0;
+	if (slot != NULL)
+	{
+		history = ProgressSlotHistory(progress_state, slot);
+		do
+		{
+			changecount = begin_slot_read(slot);
+			count = slot->history_count;
+			first = slot->history_next - count;
+			if (first < 0)
+				first += progress_state->history_size;
+
+			for (i = 0; i < count; i++)
+				samples[i] = history[(first + i) % progress_state->history_size];
+		} while (retry_slot_read(slot, changecount));
+	}
+	LWLockRelease(progress_state->lock);
+
+	for (i = 0; i < count; i++)
+	{
+		Datum	values[PG_PROGRESS_HISTORY_COLS];
+		bool	nulls[PG_PROGRESS_HISTORY_COLS];
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = TimestampTzGetDatum(samples[i].time);
+		values[1] = Float8GetDatum(samples[i].estimate);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+
+#define PG_PROGRESS_COMMAND_COLS 8
+
+Datum
+pg_progress_command(PG_FUNCTION_ARGS)
+{
+	ProgressCommand		command;
+	double				estimate;
+	TupleDesc			tupdesc;
+	Datum				values[PG_PROGRESS_COMMAND_COLS];
+	bool				nulls[PG_PROGRESS_COMMAND_COLS];
+	int					i = 0;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (!copy_command(PG_GETARG_INT32(0), &command, &estimate))
+		PG_RETURN_NULL();
+
+	memset(nulls, 0, sizeof(nulls));
+
+	values[i++] = CStringGetTextDatum(command.command);
+	values[i++] = CStringGetTextDatum(command.phase);
+	values[i++] = Float8GetDatum(estimate);
+	if (command.bytes_done < 0.0)
+		nulls[i++] = true;
+	else
+		values[i++] = Float8GetDatum(command.bytes_done);
+	if (command.bytes_total < 0.0)
+		nulls[i++] = true;
+	else
+		values[i++] = Float8GetDatum(command.bytes_total);
+	values[i++] = Float8GetDatum(command.rows_done);
+	if (command.rows_total < 0.0)
+		nulls[i++] = true;
+	else
+		values[i++] = Float8GetDatum(command.rows_total);
+	values[i++] = Float8GetDatum(command.rate);
+
+	Assert(i == PG_PROGRESS_COMMAND_COLS);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc),
+													  values, nulls)));
+}
+
+
+#define PG_PROGRESS_BACKENDS_COLS 7
+
+/*
+ * List every backend with a directory slot, so that monitoring tools can get
+ * the state of all of them with a single query.
+ */
+Datum
+pg_progress_backends(PG_FUNCTION_ARGS)
+{
+	ProgressSlot		*slots;
+	TupleDesc			 tupdesc;
+	Tuplestorestate		*tupstore;
+	int					 no_slots = 0;
+	int					 i;
 
 	if (progress_state == NULL)
 		elog(ERROR, "progress.so should be preloaded");
 
+	tupstore = begin_materialize(fcinfo, &tupdesc);
+
+	slots = palloc(sizeof(ProgressSlot) * progress_state->max_slots);
+
 	LWLockAcquire(progress_state->lock, LW_SHARED);
-	strncpy(data, progress_state->dot_dump, PROGRESS_DOT_DUMP_SIZE);
-	data[PROGRESS_DOT_DUMP_SIZE - 1] = '\0';
+	for (i = 0; i < progress_state->max_slots; i++)
+	{
+		ProgressSlot	*slot = &progress_state->slots[i];
+		int				 count;
+
+		if (slot->pid == 0)
+			continue;
+
+		do
+		{
+			count = begin_slot_read(slot);
+			slots[no_slots] = *slot;
+		} while (retry_slot_read(slot, count));
+		no_slots++;
+	}
 	LWLockRelease(progress_state->lock);
 
-	PG_RETURN_TEXT_P(cstring_to_text(data));
+	for (i = 0; i < no_slots; i++)
+	{
+		ProgressSlot	*slot = &slots[i];
+		Datum			 values[PG_PROGRESS_BACKENDS_COLS];
+		bool			 nulls[PG_PROGRESS_BACKENDS_COLS];
+		int				 j = 0;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[j++] = Int32GetDatum(slot->pid);
+		values[j++] = BoolGetDatum(slot->running);
+		values[j++] = TimestampTzGetDatum(slot->query_start);
+		values[j++] = Float8GetDatum(slot->estimate);
+		if (slot->bottleneck < 0)
+			nulls[j++] = true;
+		else
+			values[j++] = Int32GetDatum(slot->bottleneck);
+		if (slot->command.command[0] == '\0')
+		{
+			nulls[j++] = true;
+			nulls[j++] = true;
+		}
+		else
+		{
+			values[j++] = CStringGetTextDatum(slot->command.command);
+			values[j++] = CStringGetTextDatum(slot->command.phase);
+		}
+
+		Assert(j == PG_PROGRESS_BACKENDS_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
 }
 
 
@@ -432,8 +2274,50 @@ _PG_init(void)
 	if (!process_shared_preload_libraries_in_progress)
 		return;
 
+	DefineCustomIntVariable("progress.max_backends",
+							"Sets the maximum number of backends publishing progress.",
+							NULL,
+							&progress_max_backends,
+							100,
+							1,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("progress.history_size",
+							"Sets the number of estimates remembered for each backend.",
+							NULL,
+							&progress_history_size,
+							1000,
+							1,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("progress.track_io",
+							 "Count block reads and writes as part of the work done by queries.",
+							 NULL,
+							 &progress_track_io,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	progress_sampler_init();
+	progress_accuracy_init();
+	progress_rowcache_init();
+	progress_recorder_init();
+
 	/* request shared memory */
-	RequestAddinShmemSpace(sizeof(ProgressSharedState));
+	RequestAddinShmemSpace(progress_memsize());
 	RequestAddinLWLocks(1);
 
 	prev_shmem_startup_hook = shmem_startup_hook;
@@ -444,6 +2328,15 @@ _PG_init(void)
 	ExecutorStart_hook = progress_ExecutorStart;
 	prev_ExecutorRun_hook = ExecutorRun_hook;
 	ExecutorRun_hook = progress_ExecutorRun;
+	prev_ExecutorFinish_hook = ExecutorFinish_hook;
+	ExecutorFinish_hook = progress_ExecutorFinish;
+	prev_ExecutorEnd_hook = ExecutorEnd_hook;
+	ExecutorEnd_hook = progress_ExecutorEnd;
+
+	/* setup utility command hooks */
+	prev_ProcessUtility_hook = ProcessUtility_hook;
+	ProcessUtility_hook = progress_ProcessUtility;
+	progress_utility_init();
 
 	/* setup instrumentation hooks */
 	InstrAlloc_hook = progress_InstrAlloc;
@@ -1,23 +1,108 @@
 #ifndef PROGRESS_H
 #define PROGRESS_H
 
-#define PROGRESS_DOT_DUMP_SIZE (1024*1024)
+#include "storage/dsm.h"
+#include "storage/lwlock.h"
+#include "utils/timestamp.h"
 
-typedef struct ProgressSharedState
+#include "progress_utility.h"
+
+#define PROGRESS_NODE_NAME_LEN 32
+
+/* per-node part of a published snapshot */
+typedef struct ProgressNodeSnapshot
+{
+	int		node_id;
+	int		parent_id;			/* -1 for the top node */
+	char	name[PROGRESS_NODE_NAME_LEN];
+	int		pipeline_id;
+	bool	is_driver;
+	double	tup_processed;
+	double	tup_estimated;
+	double	rate;				/* tuples per second since the last snapshot */
+	double	blks_read;			/* with progress.track_io, zero otherwise */
+	double	blks_written;
+} ProgressNodeSnapshot;
+
+/* a published snapshot, the DOT dump follows the array of nodes */
+typedef struct ProgressSnapshot
+{
+	int						no_nodes;
+	Size					dot_len;
+	ProgressNodeSnapshot	nodes[FLEXIBLE_ARRAY_MEMBER];
+} ProgressSnapshot;
+
+#define ProgressSnapshotDot(snap) ((char *) &(snap)->nodes[(snap)->no_nodes])
+
+/*
+ * An entry in the shared progress directory. Each backend that publishes
+ * progress owns one slot, the snapshot itself lives in a DSM segment owned by
+ * the backend and reused until a snapshot outgrows it.
+ *
+ * The directory lock only protects claiming and releasing slots. Everything
+ * else but snapshot_requested is written by the owning backend alone, partly
+ * from a signal handler, so it doesn't lock anything. Instead, it increments
+ * changecount before and after each update, and readers retry until they see
+ * the same even count before and after copying, like with PgBackendStatus.
+ */
+typedef struct ProgressSlot
 {
-	LWLockId	lock;
+	int			pid;			/* owning backend, 0 if the slot is free */
+	int			changecount;	/* odd while the owner is updating the slot */
+	bool		snapshot_requested;	/* set by anyone wanting a full snapshot */
+	bool		running;		/* is an instrumented query executing? */
+	TimestampTz	query_start;
 	double		estimate;
-	char		dot_dump[PROGRESS_DOT_DUMP_SIZE];
+	dsm_handle	snapshot;		/* only valid if snapshot_size > 0 */
+	Size		snapshot_size;
+	int			bottleneck;		/* pipeline with the most work left, or -1 */
+	ProgressCommand	command;	/* progress of the running utility command */
+	int			history_next;	/* next position to write in the history */
+	int			history_count;	/* number of valid history entries */
+} ProgressSlot;
+
+/* a single entry in a slot's history of estimates */
+typedef struct ProgressSample
+{
+	TimestampTz	time;
+	double		estimate;
+} ProgressSample;
+
+/*
+ * The shared progress state. The slots are followed by an array of
+ * history_size samples for each slot, used as a ring buffer holding the
+ * estimates of the slot's current (or last) query.
+ */
+typedef struct ProgressSharedState
+{
+	LWLockId		lock;
+	int				max_slots;
+	int				history_size;
+	ProgressSlot	slots[FLEXIBLE_ARRAY_MEMBER];
 } ProgressSharedState;
 
+#define ProgressSlotHistory(state, slot) \
+	((ProgressSample *) &(state)->slots[(state)->max_slots] + \
+	 ((slot) - (state)->slots) * (state)->history_size)
+
 void		_PG_init(void);
 
 Datum pg_progress_update(PG_FUNCTION_ARGS);
 Datum pg_progress(PG_FUNCTION_ARGS);
 Datum pg_progress_dot(PG_FUNCTION_ARGS);
+Datum pg_progress_json(PG_FUNCTION_ARGS);
+Datum pg_progress_nodes(PG_FUNCTION_ARGS);
+Datum pg_progress_history(PG_FUNCTION_ARGS);
+Datum pg_progress_command(PG_FUNCTION_ARGS);
+Datum pg_progress_backends(PG_FUNCTION_ARGS);
 
 PG_FUNCTION_INFO_V1(pg_progress_update);
 PG_FUNCTION_INFO_V1(pg_progress);
 PG_FUNCTION_INFO_V1(pg_progress_dot);
+PG_FUNCTION_INFO_V1(pg_progress_json);
+PG_FUNCTION_INFO_V1(pg_progress_nodes);
+PG_FUNCTION_INFO_V1(pg_progress_history);
+PG_FUNCTION_INFO_V1(pg_progress_command);
+PG_FUNCTION_INFO_V1(pg_progress_backends);
 
 #endif   /* PROGRESS_H */
@@ -0,0 +1,299 @@
+/*------------------------------------------------------------------------
+ *
+ * progress_accuracy.c
+ *	   log of progress estimator accuracy for finished queries
+ *
+ * For every query id, a bounded shared hash table keeps the progress curve
+ * observed over the query's runs, the error of the published estimates
+ * against the fraction of time that had actually elapsed and the estimated
+ * and actual number of tuples processed by each pipeline in the last run.
+ *
+ * Copyright (c) 2013, PostgreSQL Global Development Group
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <math.h>
+
+#include "catalog/pg_type.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/array.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+
+#include "progress_accuracy.h"
+#include "progress_util.h"
+
+
+/*
+ * The counters of an entry are protected by its mutex, the lock only protects
+ * the hash table itself, like in pg_stat_statements.
+ */
+typedef struct ProgressAccuracyEntry
+{
+	uint32		queryid;		/* hash key of entry - MUST BE FIRST */
+	slock_t		mutex;
+	double		usage;			/* usage factor, for eviction */
+	int64		calls;
+	int64		samples;		/* number of estimates published */
+	double		total_time;		/* in seconds */
+	double		sum_abs_error;
+	double		max_abs_error;
+	int64		trace_calls;	/* number of runs that contributed to trace */
+	double		trace[PROGRESS_TRACE_POINTS];	/* mean estimate at each point */
+	int			no_pipelines;
+	double		pipeline_estimated[PROGRESS_ACCURACY_PIPELINES];
+	double		pipeline_actual[PROGRESS_ACCURACY_PIPELINES];
+} ProgressAccuracyEntry;
+
+typedef struct ProgressAccuracySharedState
+{
+	LWLockId	lock;
+} ProgressAccuracySharedState;
+
+
+/* GUC variables */
+static int	progress_accuracy_max = 1000;
+
+/* shared memory state */
+static ProgressAccuracySharedState	*accuracy_state = NULL;
+static HTAB							*accuracy_hash = NULL;
+
+
+Datum pg_progress_accuracy(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(pg_progress_accuracy);
+
+
+static Size
+accuracy_memsize(void)
+{
+	return add_size(MAXALIGN(sizeof(ProgressAccuracySharedState)),
+					hash_estimate_size(progress_accuracy_max,
+									   sizeof(ProgressAccuracyEntry)));
+}
+
+
+/*
+ * Define the GUCs and request shared memory. Must be called while loading
+ * shared_preload_libraries.
+ */
+void
+progress_accuracy_init(void)
+{
+	DefineCustomIntVariable("progress.accuracy_max",
+							"Sets the maximum number of queries whose estimator accuracy is logged.",
+							NULL,
+							&progress_accuracy_max,
+							1000,
+							100,
+							INT_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	RequestAddinShmemSpace(accuracy_memsize());
+	RequestAddinLWLocks(1);
+}
+
+
+/* must be called with AddinShmemInitLock held */
+void
+progress_accuracy_shmem_startup(void)
+{
+	bool		found;
+	HASHCTL		info;
+
+	accuracy_state = ShmemInitStruct("progress accuracy",
+									 sizeof(ProgressAccuracySharedState),
+									 &found);
+	if (!found)
+		accuracy_state->lock = LWLockAssign();
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(uint32);
+	info.entrysize = sizeof(ProgressAccuracyEntry);
+	info.hash = tag_hash;
+	accuracy_hash = ShmemInitHash("progress accuracy hash",
+								  progress_accuracy_max, progress_accuracy_max,
+								  &info,
+								  HASH_ELEM | HASH_FUNCTION);
+}
+
+
+/*
+ * Record a finished run of a query. The points are the estimates published
+ * while it was running, in chronological order, and the pipeline arrays hold
+ * the planner's and the actual number of tuples processed by each pipeline.
+ */
+void
+progress_accuracy_store(uint32 queryid, double total_time,
+						ProgressTracePoint *points, int no_points,
+						double *pipeline_estimated, double *pipeline_actual,
+						int no_pipelines)
+{
+	ProgressAccuracyEntry	*entry;
+	bool					 found;
+	double					 trace[PROGRESS_TRACE_POINTS];
+	double					 sum_abs_error = 0.0;
+	double					 max_abs_error = 0.0;
+	int						 i;
+	int						 j;
+
+	if (accuracy_hash == NULL || total_time <= 0.0)
+		return;
+
+	/* compare each estimate with the fraction of time that really elapsed */
+	for (i = 0; i < no_points; i++)
+	{
+		double	error = fabs(points[i].estimate -
+							 points[i].elapsed / total_time);
+
+		sum_abs_error += error;
+		max_abs_error = Max(max_abs_error, error);
+	}
+
+	/*
+	 * Resample the curve to fixed points in time, taking the most recent
+	 * estimate published before each point. Before the first estimate is
+	 * published, progress is reported as zero.
+	 */
+	for (i = 0, j = 0; i < PROGRESS_TRACE_POINTS; i++)
+	{
+		double	at = total_time * (i + 1) / PROGRESS_TRACE_POINTS;
+
+		while (j < no_points && points[j].elapsed <= at)
+			j++;
+
+		trace[i] = j > 0 ? points[j - 1].estimate : 0.0;
+	}
+
+	no_pipelines = Min(no_pipelines, PROGRESS_ACCURACY_PIPELINES);
+
+	entry = hash_enter_by_usage(accuracy_hash, accuracy_state->lock, &queryid,
+								progress_accuracy_max,
+								offsetof(ProgressAccuracyEntry, usage), &found);
+	if (!found)
+	{
+		memset((char *) entry + sizeof(uint32), 0,
+			   sizeof(ProgressAccuracyEntry) - sizeof(uint32));
+		SpinLockInit(&entry->mutex);
+		entry->usage = PROGRESS_USAGE_INIT;
+	}
+
+	SpinLockAcquire(&entry->mutex);
+
+	entry->usage += 1.0;
+	entry->calls++;
+	entry->samples += no_points;
+	entry->total_time += total_time;
+	entry->sum_abs_error += sum_abs_error;
+	entry->max_abs_error = Max(entry->max_abs_error, max_abs_error);
+
+	/* only runs for which we have seen any estimates are part of the trace */
+	if (no_points > 0)
+	{
+		entry->trace_calls++;
+		for (i = 0; i < PROGRESS_TRACE_POINTS; i++)
+			entry->trace[i] += (trace[i] - entry->trace[i]) / entry->trace_calls;
+	}
+
+	entry->no_pipelines = no_pipelines;
+	for (i = 0; i < no_pipelines; i++)
+	{
+		entry->pipeline_estimated[i] = pipeline_estimated[i];
+		entry->pipeline_actual[i] = pipeline_actual[i];
+	}
+
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(accuracy_state->lock);
+}
+
+
+static Datum
+float8_array(double *values, int n)
+{
+	Datum	   *datums = palloc(sizeof(Datum) * Max(n, 1));
+	int			i;
+
+	for (i = 0; i < n; i++)
+		datums[i] = Float8GetDatum(values[i]);
+
+	return PointerGetDatum(construct_array(datums, n, FLOAT8OID,
+										   sizeof(float8), FLOAT8PASSBYVAL,
+										   'd'));
+}
+
+
+#define PG_PROGRESS_ACCURACY_COLS 9
+
+Datum
+pg_progress_accuracy(PG_FUNCTION_ARGS)
+{
+	TupleDesc				 tupdesc;
+	Tuplestorestate			*tupstore;
+	HASH_SEQ_STATUS			 hash_seq;
+	ProgressAccuracyEntry	*entry;
+	ProgressAccuracyEntry	 tmp;
+
+	if (accuracy_hash == NULL)
+		elog(ERROR, "progress.so should be preloaded");
+
+	tupstore = begin_materialize(fcinfo, &tupdesc);
+
+	LWLockAcquire(accuracy_state->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, accuracy_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum	values[PG_PROGRESS_ACCURACY_COLS];
+		bool	nulls[PG_PROGRESS_ACCURACY_COLS];
+		int		i = 0;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		/* copy the counters, so they are consistent */
+		SpinLockAcquire(&entry->mutex);
+		tmp = *entry;
+		SpinLockRelease(&entry->mutex);
+		entry = &tmp;
+
+		values[i++] = Int64GetDatum((int64) entry->queryid);
+		values[i++] = Int64GetDatum(entry->calls);
+		values[i++] = Int64GetDatum(entry->samples);
+		values[i++] = Float8GetDatum(entry->total_time * 1000.0);
+		if (entry->samples > 0)
+		{
+			values[i++] = Float8GetDatum(entry->sum_abs_error /
+											 entry->samples);
+			values[i++] = Float8GetDatum(entry->max_abs_error);
+			values[i++] = float8_array(entry->trace, PROGRESS_TRACE_POINTS);
+		}
+		else
+		{
+			nulls[i++] = true;
+			nulls[i++] = true;
+			nulls[i++] = true;
+		}
+		values[i++] = float8_array(entry->pipeline_estimated,
+								   entry->no_pipelines);
+		values[i++] = float8_array(entry->pipeline_actual,
+								   entry->no_pipelines);
+
+		Assert(i == PG_PROGRESS_ACCURACY_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(accuracy_state->lock);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
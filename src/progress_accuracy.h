@@ -0,0 +1,24 @@
+#ifndef PROGRESS_ACCURACY_H
+#define PROGRESS_ACCURACY_H
+
+/* number of points the progress curve of a query is resampled to */
+#define PROGRESS_TRACE_POINTS 20
+/* number of pipelines for which estimated and actual tuples are kept */
+#define PROGRESS_ACCURACY_PIPELINES 16
+
+/* an estimate published while a query was running */
+typedef struct ProgressTracePoint
+{
+	double	elapsed;			/* seconds since the query started */
+	double	estimate;
+} ProgressTracePoint;
+
+void progress_accuracy_init(void);
+void progress_accuracy_shmem_startup(void);
+
+void progress_accuracy_store(uint32 queryid, double total_time,
+							 ProgressTracePoint *points, int no_points,
+							 double *pipeline_estimated,
+							 double *pipeline_actual, int no_pipelines);
+
+#endif   /* PROGRESS_ACCURACY_H */
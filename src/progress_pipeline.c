@@ -9,6 +9,11 @@
  */
 #include "postgres.h"
 
+#include <math.h>
+
+#include "miscadmin.h"
+#include "utils/rel.h"
+
 #include "progress_pipeline.h"
 #include "progress_util.h"
 
@@ -117,6 +122,71 @@ mark_Hash(HashState *node, List *children, void *context)
 }
 
 
+/*
+ * An Append runs its children one after another, so each child keeps its own
+ * pipeline and the node drives a new one, with its expected rows tracked per
+ * child. With a single child it just passes its tuples through, like the
+ * nodes handled by mark_dummy.
+ */
+static void
+mark_Append(AppendState *node, List *children, void *context)
+{
+	ProgressInstr	*instr = PROGRESS_INSTR(node);
+	int				*current = context;
+
+	if (node->as_nplans == 1)
+	{
+		instr->pipeline_id = PROGRESS_INSTR(node->appendplans[0])->pipeline_id;
+		return;
+	}
+
+	instr->pipeline_id = (*current)++;
+	instr->is_driver = true;
+}
+
+
+/*
+ * A MergeAppend pulls from all of its children at once, so like a MJ it
+ * merges their pipelines into one, driven by all of their drivers together.
+ */
+static void
+mark_MergeAppend(MergeAppendState *node, List *children, void *context)
+{
+	ProgressInstr	*instr = PROGRESS_INSTR(node);
+	int				*current = context;
+	int				 i;
+
+	if (node->ms_nplans == 0)
+	{
+		instr->pipeline_id = (*current)++;
+		instr->is_driver = true;
+		return;
+	}
+
+	instr->pipeline_id = PROGRESS_INSTR(node->mergeplans[0])->pipeline_id;
+	for (i = 1; i < node->ms_nplans; i++)
+		change_pipeline_id(node->mergeplans[i], instr->pipeline_id);
+}
+
+
+/*
+ * A RecursiveUnion drives its own pipeline. The recursive term is rescanned
+ * for every iteration, so like the inner side of a NL it becomes part of that
+ * pipeline and can't contain driver nodes.
+ */
+static void
+mark_RecursiveUnion(RecursiveUnionState *node, List *children, void *context)
+{
+	ProgressInstr	*instr = PROGRESS_INSTR(node);
+	int				*current = context;
+
+	instr->pipeline_id = (*current)++;
+	change_pipeline_id(innerPlanState(node), instr->pipeline_id);
+	unmark_driver_nodes(innerPlanState(node));
+	instr->is_driver = true;
+}
+
+
 static void
 mark_dummy(PlanState *node, List *children, void *context)
 {
@@ -170,6 +240,19 @@ find_pipelines_walker(PlanState *node, List *children, void *context)
 			mark_HashJoin((HashJoinState *) node, children, context);
 			break;
 
+		case T_AppendState:
+			mark_Append((AppendState *) node, children, context);
+			break;
+
+		case T_MergeAppendState:
+			mark_MergeAppend((MergeAppendState *) node, children, context);
+			break;
+
+		case T_RecursiveUnionState:
+			mark_RecursiveUnion((RecursiveUnionState *) node, children,
+								context);
+			break;
+
 		/* hash nodes are part of theit child's pipelines */
 		case T_HashState:
 			mark_Hash((HashState *) node, children, context);
@@ -183,12 +266,14 @@ find_pipelines_walker(PlanState *node, List *children, void *context)
 		case T_UniqueState:
 		case T_SetOpState:
 		case T_LockRowsState:
-		case T_LimitState:
 			instr->pipeline_id = (*current)++;
 			instr->is_driver = true;
 			break;
 
-		/* handle the remaining nodes somehow */
+		/*
+		 * handle the remaining nodes somehow, a Limit just stops pulling
+		 * tuples from its child, so it ends up in the child's pipeline
+		 */
 		default:
 			mark_dummy(node, children, context);
 			break;
@@ -213,6 +298,142 @@ renumber_pipelines_walker(PlanState *node, List *children, void *context)
 
 
 
+static double
+relation_pages(PlanState *node)
+{
+	Relation	rel = ((ScanState *) node)->ss_currentRelation;
+
+	if (rel == NULL)
+		return 0.0;
+
+	return rel->rd_rel->relpages;
+}
+
+
+/* number of relation blocks a node is expected to access in a single loop */
+static double
+estimate_blocks(PlanState *node)
+{
+	Plan	*plan = node->plan;
+
+	switch (nodeTag(node))
+	{
+		case T_SeqScanState:
+			return relation_pages(node);
+
+		/* assume each tuple comes from a different page, up to all of them */
+		case T_IndexScanState:
+		case T_BitmapHeapScanState:
+			return Min(relation_pages(node), plan->plan_rows);
+
+		default:
+			return 0.0;
+	}
+}
+
+
+/*
+ * Number of temporary blocks a node is expected to read and write in a single
+ * loop. Nodes that keep their input in memory spill it to disk if it doesn't
+ * fit in work_mem, and then each block is written once and read back once.
+ */
+static double
+estimate_temp_blocks(PlanState *node)
+{
+	Plan			*plan  = node->plan;
+	ProgressInstr	*instr = PROGRESS_INSTR(node);
+	double			 bytes;
+
+	switch (nodeTag(node))
+	{
+		/*
+		 * A Sort right below a Limit is told how many tuples are needed and
+		 * only keeps those in memory. Any other Sort holds all of its input,
+		 * and so does a bounded one whose tuples don't fit.
+		 */
+		case T_SortState:
+			bytes = plan->plan_rows * plan->plan_width;
+			if (bytes * (instr->bounded ? instr->row_fraction : 1.0) <=
+				work_mem * 1024.0)
+				return 0.0;
+			return 2.0 * ceil(bytes / BLCKSZ);
+
+		case T_MaterialState:
+		case T_HashState:
+			bytes = plan->plan_rows * plan->plan_width;
+			if (bytes <= work_mem * 1024.0)
+				return 0.0;
+			return 2.0 * ceil(bytes / BLCKSZ);
+
+		default:
+			return 0.0;
+	}
+}
+
+
+/*
+ * Does the node read all of its input before returning anything? If so, it
+ * doesn't matter how many of its tuples are needed above it, its children
+ * have to produce everything.
+ */
+static bool
+consumes_all_input(PlanState *node)
+{
+	switch (nodeTag(node))
+	{
+		case T_SortState:
+		case T_HashState:
+		case T_ModifyTableState:
+			return true;
+
+		case T_AggState:
+			return ((Agg *) node->plan)->aggstrategy != AGG_SORTED;
+
+		case T_SetOpState:
+			return ((SetOp *) node->plan)->strategy == SETOP_HASHED;
+
+		default:
+			return false;
+	}
+}
+
+
+/* the number of tuples a Limit pulls from its child, including the offset */
+static double
+limit_rows_needed(LimitState *node)
+{
+	Limit			*plan  = (Limit *) node->ps.plan;
+	ProgressInstr	*instr = PROGRESS_INSTR(node);
+	double			 rows;
+
+	rows = plan->plan.plan_rows * instr->row_fraction;
+
+	if (plan->limitOffset != NULL && IsA(plan->limitOffset, Const))
+	{
+		Const	*offset = (Const *) plan->limitOffset;
+
+		if (!offset->constisnull)
+			rows += Max(DatumGetInt64(offset->constvalue), 0);
+	}
+
+	return rows;
+}
+
+
+static void
+set_row_fraction(PlanState *node, double fraction)
+{
+	PROGRESS_INSTR(node)->row_fraction = Min(Max(fraction, 0.0), 1.0);
+}
+
+
+/*
+ * Nodes above a Limit stop pulling tuples from it after a number of rows, so
+ * non-blocking nodes below it only produce a fraction of their estimated rows.
+ * The fraction propagates down until reaching a node that needs all of its
+ * input anyway, like a Sort. The Sort itself still only returns a fraction of
+ * its rows, which is what makes a top-N sort cheap.
+ */
 static void
 planner_estimates_walker(PlanState *node, List *children, void *context)
 {
@@ -220,7 +441,12 @@ planner_estimates_walker(PlanState *node, List *children, void *context)
 	ProgressInstr		*instr = PROGRESS_INSTR(node);
 	ListCell			*lc;
 
-	instr->tup_estimated = plan->plan_rows * instr->loops_estimated;
+	instr->tup_estimated = plan->plan_rows * instr->loops_estimated *
+		instr->row_fraction;
+	instr->blks_estimated = estimate_blocks(node) * instr->loops_estimated *
+		instr->row_fraction;
+	instr->temp_blks_estimated = estimate_temp_blocks(node) *
+		instr->loops_estimated;
 
 	foreach(lc, children)
 	{
@@ -228,29 +454,99 @@ planner_estimates_walker(PlanState *node, List *children, void *context)
 		ProgressInstr	*childinstr = PROGRESS_INSTR(child);
 
 		childinstr->loops_estimated = instr->loops_estimated;
+		childinstr->row_fraction = consumes_all_input(node) ?
+			1.0 : instr->row_fraction;
 	}
 
-	if (nodeTag(node) == T_NestLoopState)
+	/*
+	 * An initPlan runs once, a correlated SubPlan runs once for each of our
+	 * tuples, any other SubPlan runs once too. None of them depends on how
+	 * many of our tuples are needed.
+	 */
+	foreach(lc, node->initPlan)
 	{
-		NestLoopState	*nstate = (NestLoopState *) node;
-		Plan			*outerplan;
-		ProgressInstr	*innerinstr;
+		PlanState	*sub = ((SubPlanState *) lfirst(lc))->planstate;
 
-		outerplan = outerPlanState(nstate)->plan;
-		innerinstr = PROGRESS_INSTR(innerPlanState(nstate));
+		PROGRESS_INSTR(sub)->loops_estimated = 1.0;
+		set_row_fraction(sub, 1.0);
+	}
+	foreach(lc, node->subPlan)
+	{
+		SubPlanState	*sstate = (SubPlanState *) lfirst(lc);
+		PlanState		*sub = sstate->planstate;
+
+		if (subplan_is_correlated(sstate))
+			PROGRESS_INSTR(sub)->loops_estimated = Max(instr->tup_estimated,
+													   1.0);
+		else
+			PROGRESS_INSTR(sub)->loops_estimated = 1.0;
+		set_row_fraction(sub, 1.0);
+	}
 
-		innerinstr->loops_estimated *= outerplan->plan_rows;
+	switch (nodeTag(node))
+	{
+		case T_LimitState:
+			{
+				PlanState	*child = outerPlanState(node);
+
+				if (child->plan->plan_rows > 0.0)
+					set_row_fraction(child,
+									 limit_rows_needed((LimitState *) node) /
+									 child->plan->plan_rows);
+				PROGRESS_INSTR(child)->bounded = IsA(child, SortState);
+				break;
+			}
+
+		/* the inner side is rescanned for each outer tuple actually read */
+		case T_NestLoopState:
+			{
+				PlanState		*outer = outerPlanState(node);
+				PlanState		*inner = innerPlanState(node);
+				ProgressInstr	*innerinstr = PROGRESS_INSTR(inner);
+
+				innerinstr->loops_estimated *= outer->plan->plan_rows *
+					PROGRESS_INSTR(outer)->row_fraction;
+				set_row_fraction(inner, 1.0);
+				break;
+			}
+
+		/* the hash table is built in full, whatever the outer side does */
+		case T_HashJoinState:
+			set_row_fraction(innerPlanState(node), 1.0);
+			break;
+
+		default:
+			break;
 	}
 }
 
 
+static void
+cached_rows_walker(PlanState *node, List *children, void *context)
+{
+	double				*rows  = context;
+	ProgressInstr		*instr = PROGRESS_INSTR(node);
+
+	instr->tup_estimated = rows[instr->node_id];
+}
+
+
+/*
+ * Set the estimated number of tuples for each node. If the same plan has run
+ * to completion before, use the row counts from that run, otherwise use the
+ * planner's estimates.
+ */
 void
 find_planner_estimates(PlanState *top, ProgressState *pstate)
 {
 	ProgressInstr		*instr = PROGRESS_INSTR(top);
 
 	instr->loops_estimated = 1.0;
+	instr->row_fraction = 1.0;
 	plan_state_walker_preorder(top, planner_estimates_walker, NULL);
+
+	if (pstate->cached_rows != NULL)
+		plan_state_walker(top, cached_rows_walker, pstate->cached_rows);
 }
 
 
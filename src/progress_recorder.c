@@ -0,0 +1,290 @@
+/*------------------------------------------------------------------------
+ *
+ * progress_recorder.c
+ *	   recording of per-node progress counters for offline replay
+ *
+ * With progress.record_directory set, every top-level query writes a binary
+ * recording of its plan shape, pipeline assignment and per-node counters
+ * sampled at a fixed interval, in the format described in
+ * progress_recording.h. A recording spans the query's whole execution, from
+ * executor start to end, over however many runs that takes. The recordings
+ * can be replayed with any estimator by tools/pg_progress_replay, without
+ * rerunning the queries.
+ *
+ * Samples are taken from the instrumentation hooks, so the clock is only
+ * checked once every PROGRESS_RECORDER_CHECK_EVERY node executions.
+ *
+ * Copyright (c) 2013, PostgreSQL Global Development Group
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "utils/guc.h"
+#include "utils/timestamp.h"
+
+#include "progress_recorder.h"
+#include "progress_util.h"
+
+#define PROGRESS_RECORDER_CHECK_EVERY 64
+
+
+/* GUC variables */
+static char	*progress_record_directory = NULL;
+static int	 progress_record_interval = 10;
+
+/* the recording in progress, if any */
+static FILE			*recording = NULL;
+static char			 recording_path[MAXPGPATH];
+static int			 recording_no_nodes;
+static TimestampTz	 recording_start;
+static TimestampTz	 next_sample;
+static TimestampTz	 sample_time;
+static int			 calls_until_check;
+static uint32		 recording_seq = 0;
+static SubTransactionId recording_subxid;
+
+
+/*
+ * The file is closed when the (sub)transaction that opened it aborts, so if
+ * that happens before the query's executor is shut down, give up on the
+ * recording first. When a subtransaction commits, the file is handed over to
+ * its parent, so follow it there.
+ */
+static void
+recorder_xact_callback(XactEvent event, void *arg)
+{
+	if (event == XACT_EVENT_ABORT)
+		progress_recorder_end(false);
+}
+
+
+static void
+recorder_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+						  SubTransactionId parentSubid, void *arg)
+{
+	if (recording == NULL || mySubid != recording_subxid)
+		return;
+
+	if (event == SUBXACT_EVENT_COMMIT_SUB)
+		recording_subxid = parentSubid;
+	else if (event == SUBXACT_EVENT_ABORT_SUB)
+		progress_recorder_end(false);
+}
+
+
+void
+progress_recorder_init(void)
+{
+	DefineCustomStringVariable("progress.record_directory",
+							   "Directory to write recordings of query progress counters to.",
+							   "Recording is disabled if empty.",
+							   &progress_record_directory,
+							   "",
+							   PGC_SUSET,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomIntVariable("progress.record_interval",
+							"Sets the interval between samples in progress recordings.",
+							NULL,
+							&progress_record_interval,
+							10,
+							1,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	RegisterXactCallback(recorder_xact_callback, NULL);
+	RegisterSubXactCallback(recorder_subxact_callback, NULL);
+}
+
+
+/* is recording enabled? */
+bool
+progress_recorder_enabled(void)
+{
+	return progress_record_directory != NULL &&
+		progress_record_directory[0] != '\0';
+}
+
+
+static int64
+recording_elapsed(TimestampTz time)
+{
+	long	secs;
+	int		usecs;
+
+	TimestampDifference(recording_start, time, &secs, &usecs);
+
+	return (int64) secs * 1000000 + usecs;
+}
+
+
+/* write to the recording, giving up on it if that fails */
+static bool
+recording_write(const void *data, size_t size)
+{
+	if (fwrite(data, size, 1, recording) == 1)
+		return true;
+
+	ereport(WARNING,
+			(errcode_for_file_access(),
+			 errmsg("could not write progress recording \"%s\": %m",
+					recording_path)));
+
+	FreeFile(recording);
+	recording = NULL;
+
+	return false;
+}
+
+
+static void
+recording_nodes_walker(PlanState *node, List *children, void *context)
+{
+	ProgressRecordingNode	*nodes = context;
+	ProgressInstr			*instr = PROGRESS_INSTR(node);
+	ProgressRecordingNode	*rnode = &nodes[instr->node_id];
+
+	rnode->node_id = instr->node_id;
+	rnode->parent_id = instr->parent_id;
+	rnode->pipeline_id = instr->pipeline_id;
+	rnode->is_driver = instr->is_driver;
+	rnode->tup_estimated = instr->tup_estimated;
+	strlcpy(rnode->name, plan_node_name(node), PROGRESS_RECORDING_NAME_LEN);
+}
+
+
+/*
+ * Start recording a query, if recording is enabled and no other query is being
+ * recorded. Returns true if the recording was started.
+ */
+bool
+progress_recorder_start(PlanState *top, int no_nodes, int no_pipelines,
+						uint32 queryid)
+{
+	ProgressRecordingHeader	 header;
+	ProgressRecordingNode	*nodes;
+	bool					 ok;
+
+	if (recording != NULL || !progress_recorder_enabled())
+		return false;
+
+	snprintf(recording_path, MAXPGPATH, "%s/%d-%u-%u.rec",
+			 progress_record_directory, MyProcPid, queryid, recording_seq++);
+
+	recording = AllocateFile(recording_path, PG_BINARY_W);
+	if (recording == NULL)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not open progress recording \"%s\": %m",
+						recording_path)));
+		return false;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PROGRESS_RECORDING_MAGIC, sizeof(header.magic));
+	header.version = PROGRESS_RECORDING_VERSION;
+	header.queryid = queryid;
+	header.no_nodes = no_nodes;
+	header.no_pipelines = no_pipelines;
+
+	nodes = palloc0(sizeof(ProgressRecordingNode) * no_nodes);
+	plan_state_walker(top, recording_nodes_walker, nodes);
+
+	ok = recording_write(&header, sizeof(header)) &&
+		recording_write(nodes, sizeof(ProgressRecordingNode) * no_nodes);
+	pfree(nodes);
+
+	if (!ok)
+		return false;
+
+	recording_no_nodes = no_nodes;
+	recording_subxid = GetCurrentSubTransactionId();
+	recording_start = GetCurrentTimestamp();
+	next_sample = recording_start;
+	calls_until_check = 1;
+
+	return true;
+}
+
+
+/* is it time to take another sample? */
+bool
+progress_recorder_due(void)
+{
+	if (recording == NULL || --calls_until_check > 0)
+		return false;
+
+	calls_until_check = PROGRESS_RECORDER_CHECK_EVERY;
+
+	sample_time = GetCurrentTimestamp();
+	if (sample_time < next_sample)
+		return false;
+
+	next_sample = TimestampTzPlusMilliseconds(sample_time,
+											  progress_record_interval);
+
+	return true;
+}
+
+
+/* write a sample, with one counter for each plan node */
+void
+progress_recorder_sample(double estimate, ProgressRecordingCounter *counters)
+{
+	ProgressRecord	record;
+
+	if (recording == NULL)
+		return;
+
+	memset(&record, 0, sizeof(record));
+	record.type = PROGRESS_RECORD_SAMPLE;
+	record.elapsed = recording_elapsed(sample_time);
+	record.estimate = estimate;
+
+	if (recording_write(&record, sizeof(record)))
+		recording_write(counters,
+						sizeof(ProgressRecordingCounter) * recording_no_nodes);
+}
+
+
+/*
+ * Finish the recording. Only queries that ran to completion get an end record,
+ * which tells the replay tool the total run time.
+ */
+void
+progress_recorder_end(bool completed)
+{
+	ProgressRecord	record;
+
+	if (recording == NULL)
+		return;
+
+	if (completed)
+	{
+		memset(&record, 0, sizeof(record));
+		record.type = PROGRESS_RECORD_END;
+		record.elapsed = recording_elapsed(GetCurrentTimestamp());
+
+		if (!recording_write(&record, sizeof(record)))
+			return;
+	}
+
+	if (FreeFile(recording) != 0)
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not close progress recording \"%s\": %m",
+						recording_path)));
+	recording = NULL;
+}
@@ -0,0 +1,18 @@
+#ifndef PROGRESS_RECORDER_H
+#define PROGRESS_RECORDER_H
+
+#include "nodes/execnodes.h"
+
+#include "progress_recording.h"
+
+void progress_recorder_init(void);
+bool progress_recorder_enabled(void);
+
+bool progress_recorder_start(PlanState *top, int no_nodes, int no_pipelines,
+							 uint32 queryid);
+bool progress_recorder_due(void);
+void progress_recorder_sample(double estimate,
+							  ProgressRecordingCounter *counters);
+void progress_recorder_end(bool completed);
+
+#endif   /* PROGRESS_RECORDER_H */
@@ -0,0 +1,68 @@
+/*------------------------------------------------------------------------
+ *
+ * progress_recording.h
+ *	   file format of progress recordings
+ *
+ * A recording starts with a header, followed by one ProgressRecordingNode
+ * for each plan node, in node id order. Then come the records, each sample
+ * record followed by one ProgressRecordingCounter for each plan node. A
+ * recording of a query that ran to completion ends with an end record. All
+ * values are stored in the byte order of the machine that wrote them.
+ *
+ * This header is shared with the standalone replay tool, so it must not
+ * depend on any server headers.
+ *
+ * Copyright (c) 2013, PostgreSQL Global Development Group
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PROGRESS_RECORDING_H
+#define PROGRESS_RECORDING_H
+
+#include <stdint.h>
+
+#define PROGRESS_RECORDING_MAGIC	"PGPRGREC"
+#define PROGRESS_RECORDING_VERSION	1
+#define PROGRESS_RECORDING_NAME_LEN	32
+
+/* record types */
+#define PROGRESS_RECORD_SAMPLE		'S'
+#define PROGRESS_RECORD_END			'E'
+
+typedef struct ProgressRecordingHeader
+{
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	queryid;
+	int32_t		no_nodes;
+	int32_t		no_pipelines;
+} ProgressRecordingHeader;
+
+/* plan shape and pipeline assignment */
+typedef struct ProgressRecordingNode
+{
+	int32_t		node_id;
+	int32_t		parent_id;			/* -1 for the top node */
+	int32_t		pipeline_id;
+	int32_t		is_driver;
+	double		tup_estimated;		/* planner's estimate, before the run */
+	char		name[PROGRESS_RECORDING_NAME_LEN];
+} ProgressRecordingNode;
+
+typedef struct ProgressRecord
+{
+	int32_t		type;
+	int32_t		unused;
+	int64_t		elapsed;			/* microseconds since the run started */
+	double		estimate;			/* estimate at that time, for samples */
+} ProgressRecord;
+
+typedef struct ProgressRecordingCounter
+{
+	double		tup_processed;
+	double		tup_estimated;		/* including corrections made at run time */
+	int32_t		finished;
+	int32_t		unused;
+} ProgressRecordingCounter;
+
+#endif   /* PROGRESS_RECORDING_H */
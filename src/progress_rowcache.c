@@ -0,0 +1,209 @@
+/*------------------------------------------------------------------------
+ *
+ * progress_rowcache.c
+ *	   cache of actual row counts from finished query runs
+ *
+ * When a query runs to completion, the number of tuples each of its plan
+ * nodes processed is remembered in a bounded shared hash table, keyed by the
+ * query id and a fingerprint of the plan's shape. The next run of the same
+ * query with the same plan uses these counts instead of the planner's
+ * estimates.
+ *
+ * Copyright (c) 2013, PostgreSQL Global Development Group
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+
+#include "progress_rowcache.h"
+#include "progress_util.h"
+
+
+typedef struct ProgressRowCacheKey
+{
+	uint32		queryid;
+	uint32		fingerprint;
+} ProgressRowCacheKey;
+
+/* the lock protects the hash table, the mutex the contents of an entry */
+typedef struct ProgressRowCacheEntry
+{
+	ProgressRowCacheKey	key;	/* hash key of entry - MUST BE FIRST */
+	slock_t				mutex;
+	double				usage;	/* usage factor, for eviction */
+	int					no_nodes;
+	double				rows[PROGRESS_ROWCACHE_MAX_NODES];
+} ProgressRowCacheEntry;
+
+typedef struct ProgressRowCacheSharedState
+{
+	LWLockId	lock;
+} ProgressRowCacheSharedState;
+
+
+/* GUC variables */
+static int	progress_rowcache_max = 1000;
+static bool	progress_use_rowcache = true;
+
+/* shared memory state */
+static ProgressRowCacheSharedState	*rowcache_state = NULL;
+static HTAB							*rowcache_hash = NULL;
+
+
+static Size
+rowcache_memsize(void)
+{
+	return add_size(MAXALIGN(sizeof(ProgressRowCacheSharedState)),
+					hash_estimate_size(progress_rowcache_max,
+									   sizeof(ProgressRowCacheEntry)));
+}
+
+
+/*
+ * Define the GUCs and request shared memory. Must be called while loading
+ * shared_preload_libraries.
+ */
+void
+progress_rowcache_init(void)
+{
+	DefineCustomIntVariable("progress.rowcache_max",
+							"Sets the maximum number of plans whose actual row counts are remembered.",
+							NULL,
+							&progress_rowcache_max,
+							1000,
+							100,
+							INT_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("progress.use_rowcache",
+							 "Use row counts from earlier runs of a query instead of planner estimates.",
+							 NULL,
+							 &progress_use_rowcache,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	RequestAddinShmemSpace(rowcache_memsize());
+	RequestAddinLWLocks(1);
+}
+
+
+/* must be called with AddinShmemInitLock held */
+void
+progress_rowcache_shmem_startup(void)
+{
+	bool		found;
+	HASHCTL		info;
+
+	rowcache_state = ShmemInitStruct("progress rowcache",
+									 sizeof(ProgressRowCacheSharedState),
+									 &found);
+	if (!found)
+		rowcache_state->lock = LWLockAssign();
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(ProgressRowCacheKey);
+	info.entrysize = sizeof(ProgressRowCacheEntry);
+	info.hash = tag_hash;
+	rowcache_hash = ShmemInitHash("progress rowcache hash",
+								  progress_rowcache_max, progress_rowcache_max,
+								  &info,
+								  HASH_ELEM | HASH_FUNCTION);
+}
+
+
+/* is looking up row counts enabled? */
+bool
+progress_rowcache_enabled(void)
+{
+	return rowcache_hash != NULL && progress_use_rowcache;
+}
+
+
+/*
+ * Look up the row counts from the last complete run of a plan. On success,
+ * rows[i] is set to the number of tuples processed by the node with id i.
+ */
+bool
+progress_rowcache_lookup(uint32 queryid, uint32 fingerprint, int no_nodes,
+						 double *rows)
+{
+	ProgressRowCacheKey		 key;
+	ProgressRowCacheEntry	*entry;
+	bool					 found = false;
+
+	if (!progress_rowcache_enabled() || no_nodes > PROGRESS_ROWCACHE_MAX_NODES)
+		return false;
+
+	memset(&key, 0, sizeof(key));
+	key.queryid = queryid;
+	key.fingerprint = fingerprint;
+
+	LWLockAcquire(rowcache_state->lock, LW_SHARED);
+
+	entry = hash_search(rowcache_hash, &key, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		SpinLockAcquire(&entry->mutex);
+		if (entry->no_nodes == no_nodes)
+		{
+			memcpy(rows, entry->rows, sizeof(double) * no_nodes);
+			entry->usage += 1.0;
+			found = true;
+		}
+		SpinLockRelease(&entry->mutex);
+	}
+
+	LWLockRelease(rowcache_state->lock);
+
+	return found;
+}
+
+
+/* Remember the row counts of a complete run of a plan. */
+void
+progress_rowcache_store(uint32 queryid, uint32 fingerprint, int no_nodes,
+						double *rows)
+{
+	ProgressRowCacheKey		 key;
+	ProgressRowCacheEntry	*entry;
+	bool					 found;
+
+	if (rowcache_hash == NULL || no_nodes > PROGRESS_ROWCACHE_MAX_NODES)
+		return;
+
+	memset(&key, 0, sizeof(key));
+	key.queryid = queryid;
+	key.fingerprint = fingerprint;
+
+	entry = hash_enter_by_usage(rowcache_hash, rowcache_state->lock, &key,
+								progress_rowcache_max,
+								offsetof(ProgressRowCacheEntry, usage), &found);
+	if (!found)
+	{
+		SpinLockInit(&entry->mutex);
+		entry->usage = PROGRESS_USAGE_INIT;
+		entry->no_nodes = 0;
+	}
+
+	SpinLockAcquire(&entry->mutex);
+	entry->usage += 1.0;
+	entry->no_nodes = no_nodes;
+	memcpy(entry->rows, rows, sizeof(double) * no_nodes);
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(rowcache_state->lock);
+}
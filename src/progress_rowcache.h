@@ -0,0 +1,16 @@
+#ifndef PROGRESS_ROWCACHE_H
+#define PROGRESS_ROWCACHE_H
+
+/* plans with more nodes than that are not cached */
+#define PROGRESS_ROWCACHE_MAX_NODES 128
+
+void progress_rowcache_init(void);
+void progress_rowcache_shmem_startup(void);
+
+bool progress_rowcache_enabled(void);
+bool progress_rowcache_lookup(uint32 queryid, uint32 fingerprint,
+							  int no_nodes, double *rows);
+void progress_rowcache_store(uint32 queryid, uint32 fingerprint,
+							 int no_nodes, double *rows);
+
+#endif   /* PROGRESS_ROWCACHE_H */
@@ -0,0 +1,132 @@
+/*------------------------------------------------------------------------
+ *
+ * progress_sampler.c
+ *	   background worker periodically sampling query progress
+ *
+ * The worker asks every backend running an instrumented query to publish a
+ * progress snapshot at a fixed interval. The backends append the estimates
+ * to their history ring buffers in shared memory, which makes the progress
+ * curve available to any client through pg_progress_history().
+ *
+ * Copyright (c) 2013, PostgreSQL Global Development Group
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "utils/guc.h"
+
+#include "progress_sampler.h"
+
+
+/* GUC variables */
+static int	progress_sampler_interval = 0;
+
+/* flags set by signal handlers */
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+
+
+static void
+progress_sampler_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sigterm = true;
+	if (MyProc)
+		SetLatch(&MyProc->procLatch);
+
+	errno = save_errno;
+}
+
+
+static void
+progress_sampler_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+	if (MyProc)
+		SetLatch(&MyProc->procLatch);
+
+	errno = save_errno;
+}
+
+
+static void
+progress_sampler_main(void *main_arg)
+{
+	pqsignal(SIGHUP, progress_sampler_sighup);
+	pqsignal(SIGTERM, progress_sampler_sigterm);
+
+	BackgroundWorkerUnblockSignals();
+
+	while (!got_sigterm)
+	{
+		int		rc;
+		long	timeout;
+
+		/* sampling can be turned off by setting the interval to 0 */
+		timeout = progress_sampler_interval > 0 ? progress_sampler_interval : 1000L;
+
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   timeout);
+		ResetLatch(&MyProc->procLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		if (progress_sampler_interval > 0 && (rc & WL_TIMEOUT))
+			progress_signal_running();
+	}
+
+	proc_exit(0);
+}
+
+
+/*
+ * Define the sampler's GUCs and register the background worker. The worker
+ * is always started and idles while the interval is 0, so sampling can be
+ * turned on with a configuration reload. Must be called while loading
+ * shared_preload_libraries.
+ */
+void
+progress_sampler_init(void)
+{
+	BackgroundWorker	worker;
+
+	DefineCustomIntVariable("progress.sampler_interval",
+							"Sets the interval between progress samples taken by the background worker.",
+							"Zero disables sampling.",
+							&progress_sampler_interval,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	memset(&worker, 0, sizeof(worker));
+	snprintf(worker.bgw_name, BGW_MAXLEN, "progress sampler");
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 10;
+	worker.bgw_main = progress_sampler_main;
+	worker.bgw_main_arg = NULL;
+
+	RegisterBackgroundWorker(&worker);
+}
@@ -0,0 +1,9 @@
+#ifndef PROGRESS_SAMPLER_H
+#define PROGRESS_SAMPLER_H
+
+void progress_sampler_init(void);
+
+/* defined in progress.c */
+int progress_signal_running(void);
+
+#endif   /* PROGRESS_SAMPLER_H */
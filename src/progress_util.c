@@ -9,8 +9,13 @@
  */
 #include "postgres.h"
 
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "access/hash.h"
+#include "lib/stringinfo.h"
 #include "nodes/pg_list.h"
 #include "nodes/execnodes.h"
+#include "utils/rel.h"
 
 #include "progress_util.h"
 
@@ -143,6 +148,242 @@ plan_state_walker_preorder(PlanState *node, ps_walker_type walker,
 	return plan_state_walker_common(node, walker, context, false);
 }
 
+static void
+number_plan_nodes_walker(PlanState *node, List *children, void *context)
+{
+	ProgressInstr	*instr = PROGRESS_INSTR(node);
+	int				*current = context;
+	ListCell		*lc;
+
+	foreach(lc, children)
+	{
+		ProgressInstr	*childinstr = PROGRESS_INSTR(lfirst(lc));
+
+		childinstr->node_id = (*current)++;
+		childinstr->parent_id = instr->node_id;
+	}
+}
+
+
+/*
+ * Assign each node a sequential id, unique within the plan, and remember the
+ * id of its parent. The top node gets id 0 and a parent id of -1.
+ */
+void
+number_plan_nodes(PlanState *top, ProgressState *pstate)
+{
+	ProgressInstr	*instr = PROGRESS_INSTR(top);
+	int				 current = 1;
+
+	instr->node_id = 0;
+	instr->parent_id = -1;
+	plan_state_walker_preorder(top, number_plan_nodes_walker, &current);
+
+	pstate->no_nodes = current;
+}
+
+
+static void
+plan_fingerprint_walker(PlanState *node, List *children, void *context)
+{
+	StringInfo	si = context;
+	uint32		values[3];
+
+	values[0] = (uint32) nodeTag(node);
+	values[1] = (uint32) list_length(children);
+	values[2] = InvalidOid;
+
+	if (IsA(node->plan, SeqScan) || IsA(node->plan, IndexScan) ||
+		IsA(node->plan, IndexOnlyScan) || IsA(node->plan, BitmapHeapScan) ||
+		IsA(node->plan, TidScan))
+	{
+		Relation	rel = ((ScanState *) node)->ss_currentRelation;
+
+		if (rel != NULL)
+			values[2] = RelationGetRelid(rel);
+	}
+
+	appendBinaryStringInfo(si, (char *) values, sizeof(values));
+}
+
+
+/*
+ * Compute a hash of the shape of a plan: the types of its nodes, the number
+ * of children of each of them and the relations scanned. Node ids assigned
+ * by number_plan_nodes are the same for all plans with equal fingerprints.
+ */
+uint32
+plan_fingerprint(PlanState *top)
+{
+	StringInfoData	si;
+	uint32			result;
+
+	initStringInfo(&si);
+	plan_state_walker_preorder(top, plan_fingerprint_walker, &si);
+
+	result = DatumGetUInt32(hash_any((const unsigned char *) si.data, si.len));
+
+	pfree(si.data);
+
+	return result;
+}
+
+
+/*
+ * Does a SubPlan run again for each row of the node evaluating it? A hashed
+ * SubPlan builds its hash table once, and one that doesn't depend on the
+ * current row just gets its result rescanned.
+ */
+bool
+subplan_is_correlated(SubPlanState *sstate)
+{
+	SubPlan		*subplan = (SubPlan *) sstate->xprstate.expr;
+
+	return !subplan->useHashTable && subplan->parParam != NIL;
+}
+
+
+/*
+ * Set up a set-returning function to return its result in materialize mode,
+ * the way pg_stat_statements does it.
+ */
+Tuplestorestate *
+begin_materialize(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	ReturnSetInfo		*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext		 per_query_ctx;
+	MemoryContext		 oldcontext;
+	Tuplestorestate		*tupstore;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	*tupdesc = CreateTupleDescCopy(*tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = *tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	return tupstore;
+}
+
+
+/* each eviction decays all usage counts and frees this many entries */
+#define USAGE_DECREASE_FACTOR	(0.99)
+#define USAGE_DEALLOC_PERCENT	5
+
+typedef struct UsageEntry
+{
+	void	*entry;
+	double	 usage;
+} UsageEntry;
+
+
+static int
+usage_cmp(const void *lhs, const void *rhs)
+{
+	double	l_usage = ((const UsageEntry *) lhs)->usage;
+	double	r_usage = ((const UsageEntry *) rhs)->usage;
+
+	if (l_usage < r_usage)
+		return -1;
+	else if (l_usage > r_usage)
+		return 1;
+	else
+		return 0;
+}
+
+
+/*
+ * Make room in a shared hash table whose entries start with their key and
+ * have a double usage count at usage_offset, the way pg_stat_statements does
+ * it: decay all the usage counts and remove the least used entries in a
+ * single batch. The caller must hold the table's lock in exclusive mode.
+ */
+void
+hash_dealloc_by_usage(HTAB *hash, Size usage_offset)
+{
+	HASH_SEQ_STATUS	 hash_seq;
+	UsageEntry		*entries;
+	void			*entry;
+	int				 no_entries = 0;
+	int				 nvictims;
+	int				 i;
+
+	entries = palloc(sizeof(UsageEntry) * Max(hash_get_num_entries(hash), 1));
+
+	hash_seq_init(&hash_seq, hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		double	*usage = (double *) ((char *) entry + usage_offset);
+
+		*usage *= USAGE_DECREASE_FACTOR;
+		entries[no_entries].entry = entry;
+		entries[no_entries].usage = *usage;
+		no_entries++;
+	}
+
+	qsort(entries, no_entries, sizeof(UsageEntry), usage_cmp);
+
+	nvictims = Max(10, no_entries * USAGE_DEALLOC_PERCENT / 100);
+	nvictims = Min(nvictims, no_entries);
+
+	for (i = 0; i < nvictims; i++)
+		hash_search(hash, entries[i].entry, HASH_REMOVE, NULL);
+
+	pfree(entries);
+}
+
+
+/*
+ * Find or add an entry of a shared hash table evicted by usage, keeping the
+ * table's lock in shared mode unless a new entry has to be added. Adding one
+ * takes the lock in exclusive mode and makes room first if the table already
+ * has max_entries entries. Returns with the lock held in either mode, so the
+ * caller must initialize new entries (found is false for them) right away and
+ * update existing ones only under a spinlock of their own.
+ */
+void *
+hash_enter_by_usage(HTAB *hash, LWLockId lock, const void *key,
+					long max_entries, Size usage_offset, bool *found)
+{
+	void	*entry;
+
+	LWLockAcquire(lock, LW_SHARED);
+
+	entry = hash_search(hash, key, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		*found = true;
+		return entry;
+	}
+
+	LWLockRelease(lock);
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+
+	if (hash_get_num_entries(hash) >= max_entries)
+		hash_dealloc_by_usage(hash, usage_offset);
+
+	/* someone else might have added it in the meantime */
+	return hash_search(hash, key, HASH_ENTER, found);
+}
+
+
 /* PlanState node to human readable name */
 char *
 plan_node_name(PlanState *node)
@@ -1,21 +1,51 @@
 #ifndef PROGRESS_UTIL_H
 #define PROGRESS_UTIL_H
 
+#include "fmgr.h"
+#include "access/tupdesc.h"
 #include "nodes/execnodes.h"
+#include "storage/lwlock.h"
+#include "utils/hsearch.h"
+#include "utils/tuplestore.h"
+#include "utils/timestamp.h"
+
+/* usage given to new entries of hash tables evicted by usage */
+#define PROGRESS_USAGE_INIT		(1.0)
 
 #define PROGRESS_INSTR(node) ((ProgressInstr *) ((PlanState *) (node))->instrument->private)
 
 typedef struct ProgressState
 {
-	int	no_pipelines;
+	int			no_pipelines;
+	int			no_nodes;
+	TimestampTz	last_sample;
+	double	   *cached_rows;	/* rows seen in an earlier run, or NULL */
 } ProgressState;
 
 typedef struct ProgressInstr {
+	int		node_id;
+	int		parent_id;
 	int		pipeline_id;
 	bool	is_driver;
 	double	tup_estimated;
 	double	loops_estimated;
+	double	row_fraction;	/* fraction of rows needed by the nodes above */
+	bool	bounded;		/* a Sort that a Limit above it makes top-N */
 	bool	finished;
+	double	tup_last_sample;
+	/* planner's estimate of blocks read, relation and temporary */
+	double	blks_estimated;
+	double	temp_blks_estimated;
+	/* blocks read and written by this node alone, not its children */
+	double	blks_hit;
+	double	blks_read;
+	double	blks_written;
+	double	temp_blks_read;
+	double	temp_blks_written;
+	/* iterations of a RecursiveUnion, rows they returned and rows in the last one */
+	double	iterations;
+	double	iter_tup_total;
+	double	iter_tup_last;
 } ProgressInstr;
 
 typedef void (*ps_walker_type) (PlanState *node, List *children, void *context);
@@ -23,6 +53,16 @@ typedef void (*ps_walker_type) (PlanState *node, List *children, void *context);
 PlanState *plan_state_walker(PlanState *node, ps_walker_type walker, void *context);
 PlanState *plan_state_walker_preorder(PlanState *node, ps_walker_type walker, void *context);
 
+void number_plan_nodes(PlanState *top, ProgressState *pstate);
+uint32 plan_fingerprint(PlanState *top);
+
 char *plan_node_name(PlanState *node);
+bool subplan_is_correlated(SubPlanState *sstate);
+
+Tuplestorestate *begin_materialize(FunctionCallInfo fcinfo, TupleDesc *tupdesc);
+
+void hash_dealloc_by_usage(HTAB *hash, Size usage_offset);
+void *hash_enter_by_usage(HTAB *hash, LWLockId lock, const void *key,
+						  long max_entries, Size usage_offset, bool *found);
 
 #endif   /* PROGRESS_UTIL_H */
@@ -0,0 +1,681 @@
+/*------------------------------------------------------------------------
+ *
+ * progress_utility.c
+ *	   progress of utility commands that bypass the executor
+ *
+ * Utility commands don't have plan nodes to instrument, so their progress is
+ * derived from whatever the backend can observe about them: the per-table
+ * statistics counters it keeps for the current transaction, the files the
+ * command reads or writes and the size of the relations it creates.
+ *
+ * Copyright (c) 2013, PostgreSQL Global Development Group
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <math.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "access/htup_details.h"
+#include "access/itup.h"
+#include "catalog/catalog.h"
+#include "catalog/namespace.h"
+#include "catalog/objectaccess.h"
+#include "catalog/pg_class.h"
+#include "nodes/parsenodes.h"
+#include "pgstat.h"
+#include "storage/bufpage.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+
+#include "progress_utility.h"
+
+
+/* how many file descriptors to examine when looking for a COPY input file */
+#define PROGRESS_MAX_FD 4096
+
+/* assumed width of index columns whose width can't be estimated otherwise */
+#define PROGRESS_DEFAULT_WIDTH 32
+
+/*
+ * Rough split of the work of building an index and of clustering a table
+ * between their phases. The first phase always reads the table, the second
+ * one sorts and the last one writes the new relation.
+ */
+#define PROGRESS_SCAN_SHARE 0.5
+#define PROGRESS_SORT_SHARE 0.2
+
+typedef enum UtilityKind
+{
+	UTILITY_NONE,
+	UTILITY_COPY_FROM,
+	UTILITY_COPY_TO,
+	UTILITY_CREATE_INDEX,
+	UTILITY_CLUSTER,
+	UTILITY_REFRESH_MATVIEW
+} UtilityKind;
+
+typedef struct UtilityProgress
+{
+	UtilityKind	kind;
+	Oid			relid;
+	char	   *filename;		/* absolute, or NULL for STDIN/STDOUT */
+	dev_t		file_dev;		/* identity of the input file, if it exists */
+	ino_t		file_ino;
+	int			fd;				/* descriptor of the input file, or -1 */
+	double		bytes_total;
+	double		rows_start;		/* table counter when the command started */
+	double		rows_total;
+	double		rows_last;
+	TimestampTz	time_last;
+	/* the relation being written by CREATE INDEX and CLUSTER */
+	bool		target_valid;
+	char		target_path[MAXPGPATH];	/* path of its main fork */
+	double		target_pages;	/* expected size of the new relation */
+	double		target_last;	/* its size at the previous sample */
+	double		query_estimate;	/* last estimate of REFRESH's query */
+} UtilityProgress;
+
+static UtilityProgress	current = {UTILITY_NONE};
+
+/* Saved hook values to avoid stepping on other plugins' toes */
+static object_access_hook_type prev_object_access_hook = NULL;
+
+
+/*
+ * Tuples inserted into a relation by this backend, including the ones in the
+ * current, uncommitted transaction.
+ */
+static double
+relation_tuples_inserted(Oid relid)
+{
+	PgStat_TableStatus		*tabentry;
+	PgStat_TableXactStatus	*trans;
+	double					 result;
+
+	tabentry = find_tabstat_entry(relid);
+	if (tabentry == NULL)
+		return 0.0;
+
+	result = tabentry->t_counts.t_tuples_inserted;
+	for (trans = tabentry->trans; trans != NULL; trans = trans->upper)
+		result += trans->tuples_inserted;
+
+	return result;
+}
+
+
+/* Tuples returned by sequential scans of a relation in this backend */
+static double
+relation_tuples_returned(Oid relid)
+{
+	PgStat_TableStatus		*tabentry;
+
+	tabentry = find_tabstat_entry(relid);
+	if (tabentry == NULL)
+		return 0.0;
+
+	return tabentry->t_counts.t_tuples_returned;
+}
+
+
+static double
+relation_reltuples(Oid relid)
+{
+	HeapTuple	tuple;
+	double		result;
+
+	tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	if (!HeapTupleIsValid(tuple))
+		return -1.0;
+
+	result = ((Form_pg_class) GETSTRUCT(tuple))->reltuples;
+	ReleaseSysCache(tuple);
+
+	return result > 0.0 ? result : -1.0;
+}
+
+
+/* Tuples fetched from a relation through indexes in this backend */
+static double
+relation_tuples_fetched(Oid relid)
+{
+	PgStat_TableStatus		*tabentry;
+
+	tabentry = find_tabstat_entry(relid);
+	if (tabentry == NULL)
+		return 0.0;
+
+	return tabentry->t_counts.t_tuples_fetched;
+}
+
+
+static double
+relation_relpages(Oid relid)
+{
+	HeapTuple	tuple;
+	double		result;
+
+	tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	if (!HeapTupleIsValid(tuple))
+		return -1.0;
+
+	result = ((Form_pg_class) GETSTRUCT(tuple))->relpages;
+	ReleaseSysCache(tuple);
+
+	return result > 0.0 ? result : -1.0;
+}
+
+
+/*
+ * Size of a relation's main fork in blocks, based on the sizes of its segment
+ * files. Unlike smgrnblocks this never errors out and doesn't allocate
+ * memory, which matters because it runs from a signal handler. The path is
+ * computed beforehand, outside of the handler.
+ */
+static double
+relfilenode_blocks(const char *path)
+{
+	char			segpath[MAXPGPATH];
+	struct stat		st;
+	double			bytes = 0.0;
+	int				segno;
+
+	for (segno = 0;; segno++)
+	{
+		if (segno == 0)
+			strlcpy(segpath, path, MAXPGPATH);
+		else
+			snprintf(segpath, MAXPGPATH, "%s.%d", path, segno);
+
+		if (stat(segpath, &st) != 0)
+			break;
+
+		bytes += st.st_size;
+	}
+
+	return floor(bytes / BLCKSZ);
+}
+
+
+static double
+utility_rows_done(void)
+{
+	switch (current.kind)
+	{
+		case UTILITY_COPY_FROM:
+			return relation_tuples_inserted(current.relid) - current.rows_start;
+		case UTILITY_COPY_TO:
+		case UTILITY_CREATE_INDEX:
+			return relation_tuples_returned(current.relid) - current.rows_start;
+		/* CLUSTER reads the table either with an index or a seqscan */
+		case UTILITY_CLUSTER:
+			return relation_tuples_returned(current.relid) +
+				relation_tuples_fetched(current.relid) - current.rows_start;
+		default:
+			return 0.0;
+	}
+}
+
+
+static void
+start_relation(Oid relid, UtilityKind kind)
+{
+	current.kind = kind;
+	current.relid = relid;
+	current.filename = NULL;
+	current.fd = -1;
+	current.bytes_total = -1.0;
+	current.rows_total = relation_reltuples(relid);
+	current.target_valid = false;
+	current.target_pages = -1.0;
+	current.target_last = 0.0;
+	current.query_estimate = -1.0;
+
+	/* the counters include earlier commands, remember where they started */
+	current.rows_start = 0.0;
+	current.rows_start = utility_rows_done();
+	current.rows_last = 0.0;
+	current.time_last = GetCurrentTimestamp();
+}
+
+
+static bool
+start_copy(CopyStmt *stmt)
+{
+	struct stat		st;
+	Oid				relid;
+
+	/* COPY (query) TO goes through the executor and is tracked there */
+	if (stmt->query != NULL || stmt->relation == NULL)
+		return false;
+
+	relid = RangeVarGetRelid(stmt->relation, NoLock, true);
+	if (!OidIsValid(relid))
+		return false;
+
+	start_relation(relid, stmt->is_from ? UTILITY_COPY_FROM : UTILITY_COPY_TO);
+
+	if (stmt->filename != NULL && !stmt->is_program)
+	{
+		char	   *path = make_absolute_path(stmt->filename);
+
+		current.filename = MemoryContextStrdup(TopMemoryContext, path);
+		free(path);
+	}
+
+	if (current.kind == UTILITY_COPY_FROM)
+	{
+		/* the table's size says nothing about how much is being loaded */
+		current.rows_total = -1.0;
+
+		if (current.filename != NULL && stat(current.filename, &st) == 0)
+		{
+			current.file_dev = st.st_dev;
+			current.file_ino = st.st_ino;
+			current.bytes_total = st.st_size;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * Estimate the number of leaf pages of a new index, from the average width of
+ * its columns and the number of rows in the table.
+ */
+static double
+estimate_index_pages(Oid relid, List *params, double rows)
+{
+	ListCell	*lc;
+	double		 width = 0.0;
+	double		 tuple_size;
+
+	foreach(lc, params)
+	{
+		IndexElem	*elem = (IndexElem *) lfirst(lc);
+		AttrNumber	 attnum;
+		int32		 attwidth = 0;
+
+		if (elem->name != NULL)
+		{
+			attnum = get_attnum(relid, elem->name);
+			if (attnum != InvalidAttrNumber)
+				attwidth = get_attavgwidth(relid, attnum);
+			if (attwidth <= 0 && attnum != InvalidAttrNumber)
+				attwidth = get_typavgwidth(get_atttype(relid, attnum),
+										   get_atttypmod(relid, attnum));
+		}
+
+		width += attwidth > 0 ? attwidth : PROGRESS_DEFAULT_WIDTH;
+	}
+
+	tuple_size = MAXALIGN(sizeof(IndexTupleData) + width) + sizeof(ItemIdData);
+
+	/* leaf pages are filled up to 90% by default */
+	return ceil(rows * tuple_size / ((BLCKSZ - SizeOfPageHeaderData) * 0.9));
+}
+
+
+static bool
+start_create_index(IndexStmt *stmt)
+{
+	Oid			relid;
+
+	relid = RangeVarGetRelid(stmt->relation, NoLock, true);
+	if (!OidIsValid(relid))
+		return false;
+
+	start_relation(relid, UTILITY_CREATE_INDEX);
+
+	if (current.rows_total > 0.0)
+		current.target_pages = estimate_index_pages(relid, stmt->indexParams,
+													current.rows_total);
+
+	return true;
+}
+
+
+static bool
+start_cluster(ClusterStmt *stmt)
+{
+	Oid			relid;
+
+	/* clustering all tables processes them one by one, don't track that */
+	if (stmt->relation == NULL)
+		return false;
+
+	relid = RangeVarGetRelid(stmt->relation, NoLock, true);
+	if (!OidIsValid(relid))
+		return false;
+
+	start_relation(relid, UTILITY_CLUSTER);
+
+	/* the new heap is expected to have as many pages as the old one */
+	current.target_pages = relation_relpages(relid);
+
+	return true;
+}
+
+
+static bool
+start_refresh_matview(RefreshMatViewStmt *stmt)
+{
+	Oid			relid;
+
+	relid = RangeVarGetRelid(stmt->relation, NoLock, true);
+	if (!OidIsValid(relid))
+		return false;
+
+	start_relation(relid, UTILITY_REFRESH_MATVIEW);
+
+	return true;
+}
+
+
+/*
+ * Notice the creation of the relation a command is writing: the new index in
+ * CREATE INDEX or the new heap in CLUSTER. It has no data yet, but its
+ * relfilenode is known and the command writes to it later on.
+ */
+static void
+progress_object_access(ObjectAccessType access, Oid classId, Oid objectId,
+					   int subId, void *arg)
+{
+	Relation	rel;
+	char		wanted;
+
+	if (prev_object_access_hook)
+		prev_object_access_hook(access, classId, objectId, subId, arg);
+
+	if (access != OAT_POST_CREATE || classId != RelationRelationId ||
+		subId != 0 || current.target_valid)
+		return;
+
+	if (current.kind == UTILITY_CREATE_INDEX)
+		wanted = RELKIND_INDEX;
+	else if (current.kind == UTILITY_CLUSTER)
+		wanted = RELKIND_RELATION;
+	else
+		return;
+
+	rel = RelationIdGetRelation(objectId);
+	if (!RelationIsValid(rel))
+		return;
+
+	if (rel->rd_rel->relkind == wanted)
+	{
+		char	*path = relpathbackend(rel->rd_node, rel->rd_backend,
+									   MAIN_FORKNUM);
+
+		strlcpy(current.target_path, path, MAXPGPATH);
+		pfree(path);
+		current.target_valid = true;
+	}
+
+	RelationClose(rel);
+}
+
+
+/*
+ * Find the descriptor COPY FROM opened to read its input file, by comparing
+ * the identity of all open files with the one of the file being read.
+ */
+static int
+find_input_fd(void)
+{
+	struct stat		st;
+	int				fd;
+
+	for (fd = 0; fd < PROGRESS_MAX_FD; fd++)
+	{
+		if (fstat(fd, &st) != 0)
+			continue;
+
+		if (st.st_dev == current.file_dev && st.st_ino == current.file_ino)
+			return fd;
+	}
+
+	return -1;
+}
+
+
+static double
+copy_bytes_done(void)
+{
+	struct stat		st;
+	off_t			pos;
+
+	if (current.filename == NULL)
+		return -1.0;
+
+	/* COPY TO writes sequentially, so the file size is the bytes written */
+	if (current.kind == UTILITY_COPY_TO)
+	{
+		if (stat(current.filename, &st) != 0)
+			return -1.0;
+		return st.st_size;
+	}
+
+	if (current.bytes_total < 0.0)
+		return -1.0;
+
+	if (current.fd < 0)
+		current.fd = find_input_fd();
+	if (current.fd < 0)
+		return 0.0;
+
+	/* the descriptor is ours, so its offset is how far COPY has read */
+	pos = lseek(current.fd, 0, SEEK_CUR);
+	if (pos < 0)
+		return -1.0;
+
+	return pos;
+}
+
+
+/*
+ * Estimate the progress of building a new relation from an existing one,
+ * which happens in three phases: reading the old relation, sorting and
+ * writing the new relation. The sorting phase is recognized by the old
+ * relation having been read and nothing having been written yet.
+ */
+static double
+relation_build_estimate(ProgressCommand *command)
+{
+	double		scanned = 0.0;
+	double		written = 0.0;
+	double		blocks = 0.0;
+
+	if (current.target_valid)
+		blocks = relfilenode_blocks(current.target_path);
+
+	if (command->rows_total > 0.0)
+		scanned = Min(command->rows_done / command->rows_total, 1.0);
+
+	if (current.target_pages > 0.0)
+		written = Min(blocks / current.target_pages, 1.0);
+
+	/* btree builds write the metapage first, ignore it */
+	if (blocks > 1.0)
+	{
+		strlcpy(command->phase, current.kind == UTILITY_CLUSTER ?
+				"writing new heap" : "loading index", PROGRESS_COMMAND_NAME_LEN);
+		/* CLUSTER rebuilds indexes once the new heap has stopped growing */
+		if (current.kind == UTILITY_CLUSTER && blocks == current.target_last &&
+			written >= 1.0)
+			strlcpy(command->phase, "rebuilding indexes",
+					PROGRESS_COMMAND_NAME_LEN);
+		current.target_last = blocks;
+
+		/* CLUSTER using an index reads and writes at the same time */
+		if (command->rate > 0.0 && scanned < 1.0)
+			return scanned;
+
+		scanned = 1.0;
+	}
+	else if (command->rows_done > 0.0 &&
+			 (scanned >= 1.0 || command->rate == 0.0))
+	{
+		strlcpy(command->phase, "sorting", PROGRESS_COMMAND_NAME_LEN);
+		scanned = 1.0;
+	}
+	else
+		strlcpy(command->phase, "scanning heap", PROGRESS_COMMAND_NAME_LEN);
+
+	current.target_last = blocks;
+
+	if (scanned < 1.0)
+		return PROGRESS_SCAN_SHARE * scanned;
+
+	return PROGRESS_SCAN_SHARE + PROGRESS_SORT_SHARE +
+		(1.0 - PROGRESS_SCAN_SHARE - PROGRESS_SORT_SHARE) * written;
+}
+
+
+/*
+ * Start tracking a utility command. Returns false if it's not a command
+ * whose progress can be tracked.
+ */
+bool
+progress_utility_start(Node *parsetree)
+{
+	current.kind = UTILITY_NONE;
+
+	switch (nodeTag(parsetree))
+	{
+		case T_CopyStmt:
+			return start_copy((CopyStmt *) parsetree);
+
+		case T_IndexStmt:
+			return start_create_index((IndexStmt *) parsetree);
+
+		case T_ClusterStmt:
+			return start_cluster((ClusterStmt *) parsetree);
+
+		case T_RefreshMatViewStmt:
+			return start_refresh_matview((RefreshMatViewStmt *) parsetree);
+
+		default:
+			return false;
+	}
+}
+
+
+void
+progress_utility_end(void)
+{
+	if (current.filename != NULL)
+		pfree(current.filename);
+
+	current.filename = NULL;
+	current.kind = UTILITY_NONE;
+}
+
+
+bool
+progress_utility_running(void)
+{
+	return current.kind != UTILITY_NONE;
+}
+
+
+/*
+ * Fill in the progress of the running utility command and return the
+ * estimated fraction of it that's done. If the command is running a query,
+ * query_estimate is that query's progress, otherwise it's negative.
+ */
+double
+progress_utility_estimate(ProgressCommand *command, double query_estimate)
+{
+	TimestampTz		now;
+	long			secs;
+	int				usecs;
+	double			elapsed;
+	double			estimate = 0.0;
+
+	Assert(progress_utility_running());
+
+	memset(command, 0, sizeof(ProgressCommand));
+
+	now = GetCurrentTimestamp();
+	TimestampDifference(current.time_last, now, &secs, &usecs);
+	elapsed = secs + usecs / 1000000.0;
+
+	command->rows_done = utility_rows_done();
+	command->rows_total = current.rows_total;
+	command->bytes_total = current.bytes_total;
+	command->rate = elapsed > 0.0 ?
+		(command->rows_done - current.rows_last) / elapsed : 0.0;
+
+	current.rows_last = command->rows_done;
+	current.time_last = now;
+
+	switch (current.kind)
+	{
+		case UTILITY_COPY_FROM:
+		case UTILITY_COPY_TO:
+			strlcpy(command->command,
+					current.kind == UTILITY_COPY_FROM ? "COPY FROM" : "COPY TO",
+					PROGRESS_COMMAND_NAME_LEN);
+			strlcpy(command->phase, "copying", PROGRESS_COMMAND_NAME_LEN);
+			command->bytes_done = copy_bytes_done();
+
+			if (command->bytes_total > 0.0 && command->bytes_done >= 0.0)
+				estimate = command->bytes_done / command->bytes_total;
+			else if (command->rows_total > 0.0)
+				estimate = command->rows_done / command->rows_total;
+			break;
+
+		case UTILITY_CREATE_INDEX:
+			strlcpy(command->command, "CREATE INDEX", PROGRESS_COMMAND_NAME_LEN);
+			command->bytes_done = -1.0;
+			estimate = relation_build_estimate(command);
+			break;
+
+		case UTILITY_CLUSTER:
+			strlcpy(command->command, "CLUSTER", PROGRESS_COMMAND_NAME_LEN);
+			command->bytes_done = -1.0;
+			estimate = relation_build_estimate(command);
+			break;
+
+		/* the query populating the view is most of the work */
+		case UTILITY_REFRESH_MATVIEW:
+			strlcpy(command->command, "REFRESH MATERIALIZED VIEW",
+					PROGRESS_COMMAND_NAME_LEN);
+			command->bytes_done = -1.0;
+			command->rows_total = -1.0;
+			if (query_estimate >= 0.0)
+			{
+				strlcpy(command->phase, "executing query",
+						PROGRESS_COMMAND_NAME_LEN);
+				current.query_estimate = query_estimate;
+			}
+			else if (current.query_estimate >= 0.0)
+				strlcpy(command->phase, "swapping heap",
+						PROGRESS_COMMAND_NAME_LEN);
+			else
+				strlcpy(command->phase, "planning", PROGRESS_COMMAND_NAME_LEN);
+			estimate = Max(current.query_estimate, 0.0);
+			break;
+
+		default:
+			break;
+	}
+
+	return Min(estimate, 1.0);
+}
+
+
+void
+progress_utility_init(void)
+{
+	prev_object_access_hook = object_access_hook;
+	object_access_hook = progress_object_access;
+}
@@ -0,0 +1,28 @@
+#ifndef PROGRESS_UTILITY_H
+#define PROGRESS_UTILITY_H
+
+#include "nodes/nodes.h"
+
+#define PROGRESS_COMMAND_NAME_LEN 32
+
+/* progress of a utility command, as published in the shared directory */
+typedef struct ProgressCommand
+{
+	char	command[PROGRESS_COMMAND_NAME_LEN];	/* empty if not a utility */
+	char	phase[PROGRESS_COMMAND_NAME_LEN];
+	double	bytes_done;
+	double	bytes_total;		/* negative if unknown */
+	double	rows_done;
+	double	rows_total;			/* negative if unknown */
+	double	rate;				/* rows per second since the last sample */
+} ProgressCommand;
+
+void progress_utility_init(void);
+
+bool progress_utility_start(Node *parsetree);
+void progress_utility_end(void);
+bool progress_utility_running(void);
+double progress_utility_estimate(ProgressCommand *command,
+								 double query_estimate);
+
+#endif   /* PROGRESS_UTILITY_H */
@@ -0,0 +1,413 @@
+/*------------------------------------------------------------------------
+ *
+ * pg_progress_replay.c
+ *	   replay progress recordings through progress estimators
+ *
+ * Reads recordings written with progress.record_directory set and runs
+ * progress estimators over every recorded sample. For each estimator, it
+ * reports how far its estimates were from the fraction of the run time that
+ * had actually elapsed, and how long computing an estimate took. Only
+ * recordings of runs that completed can be replayed.
+ *
+ * The estimators reimplement the ones in progress.c on top of the recorded
+ * counters, so that changes to them can be evaluated without rerunning the
+ * recorded queries.
+ *
+ * Copyright (c) 2013, PostgreSQL Global Development Group
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "progress_recording.h"
+
+#define Max(x, y)		((x) > (y) ? (x) : (y))
+#define Min(x, y)		((x) < (y) ? (x) : (y))
+
+/* a recording loaded in memory */
+typedef struct Recording
+{
+	ProgressRecordingHeader	 header;
+	ProgressRecordingNode	*nodes;
+	int						 no_samples;
+	int64_t					*elapsed;		/* of each sample */
+	double					*estimates;		/* recorded online */
+	ProgressRecordingCounter *counters;		/* no_nodes for each sample */
+	int64_t					 total;			/* run time */
+} Recording;
+
+typedef double (*estimator_type) (Recording *rec, ProgressRecordingCounter *counters,
+								  int sample);
+
+typedef struct Estimator
+{
+	const char		*name;
+	const char		*description;
+	estimator_type	 estimate;
+	/* accumulated over all replayed samples */
+	long			 samples;
+	double			 abs_error;
+	double			 max_abs_error;
+	double			 nsecs;
+} Estimator;
+
+
+/**************/
+/* Estimators */
+/**************/
+
+/* the estimate the backend computed while the query ran */
+static double
+recorded_estimator(Recording *rec, ProgressRecordingCounter *counters,
+				   int sample)
+{
+	return rec->estimates[sample];
+}
+
+
+/* processed tuples against expected tuples, ignoring pipelines */
+static double
+naive_estimator(Recording *rec, ProgressRecordingCounter *counters,
+				int sample)
+{
+	double	processed = 0.0;
+	double	estimated = 0.0;
+	int		i;
+
+	for (i = 0; i < rec->header.no_nodes; i++)
+	{
+		processed += counters[i].tup_processed;
+		estimated += Max(counters[i].tup_processed, counters[i].tup_estimated);
+	}
+
+	return estimated > 0.0 ? processed / estimated : 0.0;
+}
+
+
+/*
+ * The driver node estimator, the same as dne_estimator, pipeline_to_process
+ * and estimate_progress in progress.c, with work measured in tuples.
+ */
+static double
+dne_estimator(Recording *rec, ProgressRecordingCounter *counters, int sample)
+{
+	int		no_pipelines = rec->header.no_pipelines;
+	double	total_processed = 0.0;
+	double	total_to_process = 0.0;
+	int		p;
+	int		i;
+
+	for (p = 0; p < no_pipelines; p++)
+	{
+		double	processed = 0.0;
+		double	estimated = 0.0;
+		double	drv_processed = 0.0;
+		double	drv_estimated = 0.0;
+		int		no_drivers = 0;
+		int		finished = 1;
+
+		for (i = 0; i < rec->header.no_nodes; i++)
+		{
+			ProgressRecordingCounter *c = &counters[i];
+
+			if (rec->nodes[i].pipeline_id != p)
+				continue;
+
+			processed += c->tup_processed;
+			estimated += Max(c->tup_processed, c->tup_estimated);
+
+			if (!rec->nodes[i].is_driver)
+				continue;
+
+			if (drv_estimated == 0.0)
+				drv_estimated = c->tup_estimated;
+			else
+				drv_estimated = Min(drv_estimated, c->tup_estimated);
+			drv_processed += c->tup_processed;
+			no_drivers++;
+
+			if (!c->finished)
+				finished = 0;
+		}
+
+		total_processed += processed;
+
+		if (finished)
+			total_to_process += processed;
+		else if (processed == 0.0 || drv_processed == 0.0)
+			total_to_process += estimated;
+		else
+			total_to_process += processed * drv_estimated /
+				(drv_processed / no_drivers);
+	}
+
+	if (total_to_process == 0.0)
+		return 0.0;
+
+	return total_processed / total_to_process;
+}
+
+
+static Estimator estimators[] = {
+	{"recorded", "estimates computed by the backend", recorded_estimator},
+	{"naive", "processed against expected tuples", naive_estimator},
+	{"dne", "driver node estimator", dne_estimator},
+	{NULL}
+};
+
+
+/**************/
+/* Recordings */
+/**************/
+
+static int
+read_exact(FILE *f, void *data, size_t size)
+{
+	return fread(data, size, 1, f) == 1;
+}
+
+
+static void
+free_recording(Recording *rec)
+{
+	free(rec->nodes);
+	free(rec->elapsed);
+	free(rec->estimates);
+	free(rec->counters);
+}
+
+
+/*
+ * Load a recording from a file. Returns 0 and complains if it's not a valid
+ * recording of a completed run.
+ */
+static int
+load_recording(const char *path, Recording *rec)
+{
+	FILE			*f;
+	ProgressRecord	 record;
+	int				 allocated = 0;
+	int				 no_nodes;
+
+	memset(rec, 0, sizeof(Recording));
+	rec->total = -1;
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+	{
+		perror(path);
+		return 0;
+	}
+
+	if (!read_exact(f, &rec->header, sizeof(rec->header)) ||
+		memcmp(rec->header.magic, PROGRESS_RECORDING_MAGIC, 8) != 0 ||
+		rec->header.version != PROGRESS_RECORDING_VERSION ||
+		rec->header.no_nodes <= 0)
+	{
+		fprintf(stderr, "%s: not a progress recording\n", path);
+		fclose(f);
+		return 0;
+	}
+
+	no_nodes = rec->header.no_nodes;
+	rec->nodes = malloc(sizeof(ProgressRecordingNode) * no_nodes);
+	if (!read_exact(f, rec->nodes, sizeof(ProgressRecordingNode) * no_nodes))
+		goto truncated;
+
+	while (read_exact(f, &record, sizeof(record)))
+	{
+		if (record.type == PROGRESS_RECORD_END)
+		{
+			rec->total = record.elapsed;
+			break;
+		}
+
+		if (record.type != PROGRESS_RECORD_SAMPLE)
+			goto truncated;
+
+		if (rec->no_samples == allocated)
+		{
+			allocated = allocated ? allocated * 2 : 64;
+			rec->elapsed = realloc(rec->elapsed, sizeof(int64_t) * allocated);
+			rec->estimates = realloc(rec->estimates, sizeof(double) * allocated);
+			rec->counters = realloc(rec->counters,
+									sizeof(ProgressRecordingCounter) *
+									no_nodes * allocated);
+			if (!rec->elapsed || !rec->estimates || !rec->counters)
+			{
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+		}
+
+		rec->elapsed[rec->no_samples] = record.elapsed;
+		rec->estimates[rec->no_samples] = record.estimate;
+		if (!read_exact(f, &rec->counters[rec->no_samples * no_nodes],
+						sizeof(ProgressRecordingCounter) * no_nodes))
+			goto truncated;
+		rec->no_samples++;
+	}
+
+	fclose(f);
+
+	if (rec->total <= 0)
+	{
+		fprintf(stderr, "%s: run did not complete, skipping\n", path);
+		free_recording(rec);
+		return 0;
+	}
+
+	return 1;
+
+truncated:
+	fprintf(stderr, "%s: truncated or corrupt recording\n", path);
+	fclose(f);
+	free_recording(rec);
+	return 0;
+}
+
+
+static double
+now_nsecs(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static void
+replay(Recording *rec, Estimator *est, const char *path, int verbose)
+{
+	double	abs_error = 0.0;
+	double	max_abs_error = 0.0;
+	int		i;
+
+	for (i = 0; i < rec->no_samples; i++)
+	{
+		ProgressRecordingCounter *counters;
+		double	start;
+		double	estimate;
+		double	actual;
+		double	error;
+
+		counters = &rec->counters[i * rec->header.no_nodes];
+
+		start = now_nsecs();
+		estimate = est->estimate(rec, counters, i);
+		est->nsecs += now_nsecs() - start;
+
+		actual = (double) rec->elapsed[i] / rec->total;
+		error = fabs(estimate - actual);
+
+		abs_error += error;
+		max_abs_error = Max(max_abs_error, error);
+	}
+
+	est->samples += rec->no_samples;
+	est->abs_error += abs_error;
+	est->max_abs_error = Max(est->max_abs_error, max_abs_error);
+
+	if (verbose && rec->no_samples > 0)
+		printf("%-10s %8d %10.4f %10.4f  %s\n", est->name, rec->no_samples,
+			   abs_error / rec->no_samples, max_abs_error, path);
+}
+
+
+static void
+usage(const char *progname)
+{
+	Estimator	*est;
+
+	fprintf(stderr,
+			"Usage: %s [-e ESTIMATOR] [-v] RECORDING...\n\n"
+			"  -e ESTIMATOR  only replay this estimator\n"
+			"  -v            report each recording separately\n\n"
+			"Estimators:\n",
+			progname);
+	for (est = estimators; est->name != NULL; est++)
+		fprintf(stderr, "  %-12s  %s\n", est->name, est->description);
+	exit(1);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	const char	*only = NULL;
+	int			 verbose = 0;
+	int			 no_recordings = 0;
+	Estimator	*est;
+	int			 c;
+	int			 i;
+
+	while ((c = getopt(argc, argv, "e:vh")) != -1)
+	{
+		switch (c)
+		{
+			case 'e':
+				only = optarg;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (optind == argc)
+		usage(argv[0]);
+
+	if (only != NULL)
+	{
+		for (est = estimators; est->name != NULL; est++)
+			if (strcmp(est->name, only) == 0)
+				break;
+		if (est->name == NULL)
+			usage(argv[0]);
+	}
+
+	if (verbose)
+		printf("%-10s %8s %10s %10s  %s\n",
+			   "ESTIMATOR", "SAMPLES", "MEAN ERR", "MAX ERR", "RECORDING");
+
+	for (i = optind; i < argc; i++)
+	{
+		Recording	rec;
+
+		if (!load_recording(argv[i], &rec))
+			continue;
+
+		for (est = estimators; est->name != NULL; est++)
+			if (only == NULL || strcmp(est->name, only) == 0)
+				replay(&rec, est, argv[i], verbose);
+
+		free_recording(&rec);
+		no_recordings++;
+	}
+
+	printf("%s%d recordings replayed\n\n", verbose ? "\n" : "", no_recordings);
+	printf("%-10s %8s %10s %10s %12s\n",
+		   "ESTIMATOR", "SAMPLES", "MEAN ERR", "MAX ERR", "LATENCY (us)");
+	for (est = estimators; est->name != NULL; est++)
+	{
+		if (only != NULL && strcmp(est->name, only) != 0)
+			continue;
+		if (est->samples == 0)
+			continue;
+
+		printf("%-10s %8ld %10.4f %10.4f %12.3f\n", est->name, est->samples,
+			   est->abs_error / est->samples, est->max_abs_error,
+			   est->nsecs / est->samples / 1000.0);
+	}
+
+	return 0;
+}
@@ -0,0 +1,201 @@
+/*------------------------------------------------------------------------
+ *
+ * pg_progress_top.c
+ *	   top-like monitor of query progress
+ *
+ * Shows every backend running an instrumented query or utility command,
+ * refreshed at a fixed interval. A single connection is used and each
+ * refresh is a single query, which reads the estimates published so far and
+ * asks the running backends for new ones, so what's displayed lags one
+ * refresh behind. Only estimates are asked for, not full snapshots of the
+ * plans, to keep the load on the monitored backends low.
+ *
+ * Copyright (c) 2013, PostgreSQL Global Development Group
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libpq-fe.h"
+
+#define REFRESH_QUERY \
+	"SELECT pid, running, " \
+	"       extract(epoch FROM now() - query_start), " \
+	"       progress, bottleneck_pipeline, command, phase, " \
+	"       CASE WHEN running THEN pg_progress_update(pid, false) END " \
+	"  FROM pg_progress_backends() " \
+	" WHERE pid <> pg_backend_pid() " \
+	" ORDER BY progress, pid"
+
+static volatile sig_atomic_t got_sigint = 0;
+
+
+static void
+handle_sigint(int signo)
+{
+	got_sigint = 1;
+}
+
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr,
+			"Usage: %s [-i SECONDS] [-n COUNT] [-b] [CONNINFO]\n\n"
+			"  -i SECONDS  refresh interval, default 0.5\n"
+			"  -n COUNT    exit after COUNT refreshes\n"
+			"  -b          batch mode, don't clear the screen\n",
+			progname);
+	exit(1);
+}
+
+
+/* format a number of seconds as h:mm:ss */
+static void
+format_interval(char *buf, size_t len, double secs)
+{
+	long	s;
+
+	if (secs < 0.0)
+	{
+		snprintf(buf, len, "-");
+		return;
+	}
+
+	s = (long) (secs + 0.5);
+	snprintf(buf, len, "%ld:%02ld:%02ld", s / 3600, (s / 60) % 60, s % 60);
+}
+
+
+static void
+print_backends(PGresult *res, int batch)
+{
+	time_t	now = time(NULL);
+	char	stamp[32];
+	int		i;
+
+	if (!batch)
+		printf("\033[H\033[2J");
+
+	strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&now));
+	printf("pg_progress_top - %s, %d backends\n\n", stamp, PQntuples(res));
+	printf("%7s %8s %9s %9s %10s  %s\n",
+		   "PID", "PROGRESS", "ELAPSED", "ETA", "BOTTLENECK", "COMMAND");
+
+	for (i = 0; i < PQntuples(res); i++)
+	{
+		int		running = strcmp(PQgetvalue(res, i, 1), "t") == 0;
+		double	elapsed = atof(PQgetvalue(res, i, 2));
+		double	progress = atof(PQgetvalue(res, i, 3));
+		double	eta = -1.0;
+		char	elapsed_buf[16];
+		char	eta_buf[16];
+		char	command[80];
+
+		/* assume the rest of the query runs at the average speed so far */
+		if (running && progress > 0.0 && progress <= 1.0)
+			eta = elapsed * (1.0 - progress) / progress;
+
+		format_interval(elapsed_buf, sizeof(elapsed_buf),
+						running ? elapsed : -1.0);
+		format_interval(eta_buf, sizeof(eta_buf), eta);
+
+		if (PQgetisnull(res, i, 5))
+			snprintf(command, sizeof(command), "%s",
+					 running ? "query" : "idle");
+		else
+			snprintf(command, sizeof(command), "%s (%s)",
+					 PQgetvalue(res, i, 5), PQgetvalue(res, i, 6));
+
+		printf("%7s %7.1f%% %9s %9s %10s  %s\n",
+			   PQgetvalue(res, i, 0), progress * 100.0, elapsed_buf, eta_buf,
+			   PQgetisnull(res, i, 4) ? "-" : PQgetvalue(res, i, 4),
+			   command);
+	}
+
+	fflush(stdout);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	const char		*conninfo = "";
+	double			 interval = 0.5;
+	long			 count = -1;
+	int				 batch = 0;
+	struct timespec	 delay;
+	PGconn			*conn;
+	int				 c;
+
+	while ((c = getopt(argc, argv, "i:n:bh")) != -1)
+	{
+		switch (c)
+		{
+			case 'i':
+				interval = atof(optarg);
+				if (interval <= 0.0)
+					usage(argv[0]);
+				break;
+			case 'n':
+				count = atol(optarg);
+				break;
+			case 'b':
+				batch = 1;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (optind < argc)
+		conninfo = argv[optind++];
+	if (optind < argc)
+		usage(argv[0]);
+
+	conn = PQconnectdb(conninfo);
+	if (PQstatus(conn) != CONNECTION_OK)
+	{
+		fprintf(stderr, "connection failed: %s", PQerrorMessage(conn));
+		PQfinish(conn);
+		return 1;
+	}
+
+	signal(SIGINT, handle_sigint);
+
+	delay.tv_sec = (time_t) interval;
+	delay.tv_nsec = (long) ((interval - delay.tv_sec) * 1000000000.0);
+
+	while (!got_sigint && count != 0)
+	{
+		PGresult	*res;
+
+		res = PQexec(conn, REFRESH_QUERY);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		{
+			fprintf(stderr, "query failed: %s", PQerrorMessage(conn));
+			PQclear(res);
+			PQfinish(conn);
+			return 1;
+		}
+
+		print_backends(res, batch);
+		PQclear(res);
+
+		if (count > 0)
+			count--;
+
+		if (count != 0 && nanosleep(&delay, NULL) < 0 && errno != EINTR)
+			break;
+	}
+
+	PQfinish(conn);
+
+	return 0;
+}